@@ -9,122 +9,26 @@
 #include <stdexcept>
 
 
-rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
+rst::pos_buf_id rst::rasterizer::load_positions(std::vector<Eigen::Vector3f> positions)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
-
-    return {id};
+    return {pos_buf.add(std::move(positions))};
 }
 
-rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+rst::pos_buf_id rst::rasterizer::load_positions(buffer_span<Eigen::Vector3f> positions)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
-
-    return {id};
+    return {pos_buf.adopt(positions)};
 }
 
-// Bresenham's line drawing algorithm
-// Code taken from a stack overflow answer: https://stackoverflow.com/a/16405254
-void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
+rst::ind_buf_id rst::rasterizer::load_indices(std::vector<Eigen::Vector3i> indices)
 {
-    auto x1 = begin.x();
-    auto y1 = begin.y();
-    auto x2 = end.x();
-    auto y2 = end.y();
-
-    Eigen::Vector3f line_color = {255, 255, 255};
-
-    int x,y,dx,dy,dx1,dy1,px,py,xe,ye,i;
-
-    dx=x2-x1;
-    dy=y2-y1;
-    dx1=fabs(dx);
-    dy1=fabs(dy);
-    px=2*dy1-dx1;
-    py=2*dx1-dy1;
+    edge_buf.add(unique_edges(indices.data(), indices.size()));
+    return {ind_buf.add(std::move(indices))};
+}
 
-    if(dy1<=dx1)
-    {
-        if(dx>=0)
-        {
-            x=x1;
-            y=y1;
-            xe=x2;
-        }
-        else
-        {
-            x=x2;
-            y=y2;
-            xe=x1;
-        }
-        Eigen::Vector3f point = Eigen::Vector3f(x, y, 1.0f);
-        set_pixel(point,line_color);
-        for(i=0;x<xe;i++)
-        {
-            x=x+1;
-            if(px<0)
-            {
-                px=px+2*dy1;
-            }
-            else
-            {
-                if((dx<0 && dy<0) || (dx>0 && dy>0))
-                {
-                    y=y+1;
-                }
-                else
-                {
-                    y=y-1;
-                }
-                px=px+2*(dy1-dx1);
-            }
-//            delay(0);
-            Eigen::Vector3f point = Eigen::Vector3f(x, y, 1.0f);
-            set_pixel(point,line_color);
-        }
-    }
-    else
-    {
-        if(dy>=0)
-        {
-            x=x1;
-            y=y1;
-            ye=y2;
-        }
-        else
-        {
-            x=x2;
-            y=y2;
-            ye=y1;
-        }
-        Eigen::Vector3f point = Eigen::Vector3f(x, y, 1.0f);
-        set_pixel(point,line_color);
-        for(i=0;y<ye;i++)
-        {
-            y=y+1;
-            if(py<=0)
-            {
-                py=py+2*dx1;
-            }
-            else
-            {
-                if((dx<0 && dy<0) || (dx>0 && dy>0))
-                {
-                    x=x+1;
-                }
-                else
-                {
-                    x=x-1;
-                }
-                py=py+2*(dx1-dy1);
-            }
-//            delay(0);
-            Eigen::Vector3f point = Eigen::Vector3f(x, y, 1.0f);
-            set_pixel(point,line_color);
-        }
-    }
+rst::ind_buf_id rst::rasterizer::load_indices(buffer_span<Eigen::Vector3i> indices)
+{
+    edge_buf.add(unique_edges(indices.data, indices.count));
+    return {ind_buf.adopt(indices)};
 }
 
 auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
@@ -138,54 +42,87 @@ void rst::rasterizer::draw(rst::pos_buf_id pos_buffer, rst::ind_buf_id ind_buffe
     {
         throw std::runtime_error("Drawing primitives other than triangle is not implemented yet!");
     }
-    auto& buf = pos_buf[pos_buffer.pos_id];
-    auto& ind = ind_buf[ind_buffer.ind_id];
-
-    float f1 = (100 - 0.1) / 2.0;
-    float f2 = (100 + 0.1) / 2.0;
+    buffer_span<Eigen::Vector3f> buf = pos_buf[pos_buffer.pos_id];
+    buffer_span<mesh_edge> edges = edge_buf[ind_buffer.ind_id];
 
     Eigen::Matrix4f mvp = projection * view * model;
-    for (auto& i : ind)
-    {
-        Triangle t;
-
-        Eigen::Vector4f v[] = {
-                mvp * to_vec4(buf[i[0]], 1.0f),
-                mvp * to_vec4(buf[i[1]], 1.0f),
-                mvp * to_vec4(buf[i[2]], 1.0f)
-        };
-
-        for (auto& vec : v) {
-            vec /= vec.w();
-        }
-
-        for (auto & vert : v)
+    near_plane near(projection);
+
+    // Each vertex is projected once, however many edges share it
+    vertices.resize(buf.size());
+    parallel_ranges(buf.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            vertices[i] = project_vertex(mvp * to_vec4(buf[i], 1.0f), near, width, height);
+    });
+
+    // Rows are split into a band per worker, and each chunk of the edges
+    // is projected and binned by the bands its segments cross
+    int bands = pool ? (int)pool->size() : 1;
+    auto band_begin = [&](int band) { return height * band / bands; };
+    bins.resize(bands);
+    parallel_ranges(bands, [&](size_t begin, size_t end) {
+        for (size_t chunk = begin; chunk < end; ++chunk)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            std::vector<std::vector<line_segment>>& chunk_bins = bins[chunk];
+            chunk_bins.resize(bands);
+            for (auto& bin : chunk_bins)
+                bin.clear();
+
+            size_t first = edges.size() * chunk / bands, last = edges.size() * (chunk + 1) / bands;
+            for (size_t i = first; i < last; ++i)
+            {
+                line_segment line;
+                if (!project_edge(vertices[edges[i].a], vertices[edges[i].b], near, width, height, line))
+                    continue;
+                if (bands == 1)
+                {
+                    chunk_bins[0].push_back(line);
+                    continue;
+                }
+                int y0 = std::min(line.y0, line.y1), y1 = std::max(line.y0, line.y1);
+                int band = (int)((long long)y0 * bands / height);
+                while (band + 1 < bands && band_begin(band + 1) <= y0)
+                    ++band;
+                for (; band < bands && band_begin(band) <= y1; ++band)
+                    chunk_bins[band].push_back(line);
+            }
         }
+    });
 
-        for (int i = 0; i < 3; ++i)
+    // Each worker draws the part of the lines in its own band of rows.
+    // Row 0 of frame_buf is the top of the screen.
+    Eigen::Vector3f line_color = {255, 255, 255};
+    Eigen::Vector3f* origin = frame_buf.data() + size_t(height - 1) * width;
+    parallel_ranges(bands, [&](size_t begin, size_t end) {
+        for (size_t band = begin; band < end; ++band)
         {
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
+            int y_begin = band_begin(band), y_end = band_begin(band + 1);
+            for (const auto& chunk_bins : bins)
+            {
+                for (const line_segment& line : chunk_bins[band])
+                    draw_segment(origin, 1, -width, line, y_begin, y_end, [&](Eigen::Vector3f& pixel) { pixel = line_color; });
+            }
         }
-
-        t.setColor(0, 255.0,  0.0,  0.0);
-        t.setColor(1, 0.0  ,255.0,  0.0);
-        t.setColor(2, 0.0  ,  0.0,255.0);
-
-        rasterize_wireframe(t);
-    }
+    });
 }
 
-void rst::rasterizer::rasterize_wireframe(const Triangle& t)
+void rst::rasterizer::parallel_ranges(size_t count, const std::function<void(size_t, size_t)>& body)
 {
-    draw_line(t.c(), t.a());
-    draw_line(t.c(), t.b());
-    draw_line(t.b(), t.a());
+    size_t workers = pool ? std::min(pool->size(), count) : 1;
+    if (workers <= 1)
+    {
+        body(0, count);
+        return;
+    }
+
+    std::vector<std::future<void>> done;
+    for (size_t w = 0; w < workers; ++w)
+    {
+        size_t begin = count * w / workers, end = count * (w + 1) / workers;
+        done.push_back(pool->submit([=, &body] { body(begin, end); }));
+    }
+    for (auto& d : done)
+        d.get();
 }
 
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
@@ -219,11 +156,15 @@ rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
     frame_buf.resize(w * h);
     depth_buf.resize(w * h);
+
+    unsigned int threads = std::thread::hardware_concurrency();
+    if (threads > 1)
+        pool = std::make_unique<ThreadPool>(threads);
 }
 
 int rst::rasterizer::get_index(int x, int y)
 {
-    return (height-y)*width + x;
+    return (height-1-y)*width + x;
 }
 
 void rst::rasterizer::set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color)
@@ -231,7 +172,7 @@ void rst::rasterizer::set_pixel(const Eigen::Vector3f& point, const Eigen::Vecto
     //old index: auto ind = point.y() + point.x() * width;
     if (point.x() < 0 || point.x() >= width ||
         point.y() < 0 || point.y() >= height) return;
-    auto ind = (height-point.y())*width + point.x();
+    int ind = (height-1-(int)point.y())*width + (int)point.x();
     frame_buf[ind] = color;
 }
 
@@ -5,7 +5,12 @@
 #pragma once
 
 #include "Triangle.hpp"
+#include "BufferStore.hpp"
+#include "ThreadPool.hpp"
+#include "Wireframe.hpp"
 #include <algorithm>
+#include <functional>
+#include <memory>
 #include <Eigen/Eigen>
 using namespace Eigen;
 
@@ -51,8 +56,12 @@ class rasterizer
 {
   public:
     rasterizer(int w, int h);
-    pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
-    ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
+    // Copies the buffer, or takes it over when it is moved in
+    pos_buf_id load_positions(std::vector<Eigen::Vector3f> positions);
+    ind_buf_id load_indices(std::vector<Eigen::Vector3i> indices);
+    // Draws from the caller's memory, which must outlive the draws
+    pos_buf_id load_positions(buffer_span<Eigen::Vector3f> positions);
+    ind_buf_id load_indices(buffer_span<Eigen::Vector3i> indices);
 
     void set_model(const Eigen::Matrix4f& m);
     void set_view(const Eigen::Matrix4f& v);
@@ -62,21 +71,30 @@ class rasterizer
 
     void clear(Buffers buff);
 
+    // Draws the wireframe of the indexed triangles, each shared edge once
     void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, Primitive type);
 
     std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
 
   private:
-    void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
-    void rasterize_wireframe(const Triangle& t);
+    // Calls body(begin, end) on ranges covering [0, count), one per worker
+    void parallel_ranges(size_t count, const std::function<void(size_t, size_t)>& body);
 
   private:
     Eigen::Matrix4f model;
     Eigen::Matrix4f view;
     Eigen::Matrix4f projection;
 
-    std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-    std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
+    buffer_store<Eigen::Vector3f> pos_buf;
+    buffer_store<Eigen::Vector3i> ind_buf;
+    // The unique_edges of each index buffer, loaded with the same id
+    buffer_store<mesh_edge> edge_buf;
+
+    // Per draw, kept to save allocating them every frame: the projected
+    // vertices, and bins[chunk][band] the visible segments of a chunk of
+    // the edges that cross a band of rows
+    std::vector<wire_vertex> vertices;
+    std::vector<std::vector<std::vector<line_segment>>> bins;
 
     std::vector<Eigen::Vector3f> frame_buf;
     std::vector<float> depth_buf;
@@ -84,7 +102,7 @@ class rasterizer
 
     int width, height;
 
-    int next_id = 0;
-    int get_next_id() { return next_id++; }
+    // Draws the wireframe, null on a single core
+    std::unique_ptr<ThreadPool> pool;
 };
 } // namespace rst
@@ -0,0 +1,298 @@
+//
+// Fixed point edge equations for screen space triangles.
+//
+// Triangle setup snaps the vertices to 1/256 pixel and builds the three
+// edge equations once. Coverage is then walked in 8x8 pixel blocks. A block
+// is skipped when it lies outside an edge at its best corner, filled
+// without per pixel tests when it lies inside all edges at their worst
+// corners, and otherwise tested one row of 8 pixels at a time. The edge
+// values at a pixel centre are its barycentric coordinates, up to the
+// triangle's area.
+//
+// A pixel centre on the edge shared by two triangles is drawn by exactly
+// one of them.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RST_EDGE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RST_EDGE_SSE
+#endif
+
+namespace rst
+{
+    // A value that is linear in screen space, at pixel centre (x, y)
+    struct plane_equation
+    {
+        double c, dx, dy;
+
+        double at(double x, double y) const { return c + x * dx + y * dy; }
+
+        // Smallest value over the pixel centres of [x0, x1] x [y0, y1]
+        double min(int x0, int y0, int x1, int y1) const
+        {
+            return at(dx > 0 ? x0 : x1, dy > 0 ? y0 : y1);
+        }
+    };
+
+    struct triangle_edges
+    {
+        static constexpr int subpixel_bits = 8;
+        static constexpr int block_size = 8;
+        // Vertices further out than this many pixels would overflow
+        static constexpr float guard_band = 1 << 20;
+
+        // Edge i runs between the two vertices other than i, so its value is
+        // the weight of vertex i. At the centre of pixel (x, y) it is
+        // origin + x * step_x + y * step_y, one less on edges that do not
+        // own the pixel centres lying on them.
+        int64_t origin[3];
+        int64_t step_x[3];
+        int64_t step_y[3];
+        int64_t bias[3];
+        // lane_x[i][k] = k * step_x[i], the offsets of a block row
+        int64_t lane_x[3][block_size];
+        double inv_area;
+
+        // False for degenerate triangles and vertices beyond guard_band
+        template <typename Vec>
+        bool setup(const Vec* v)
+        {
+            const float scale = 1 << subpixel_bits;
+            int64_t X[3], Y[3];
+            for (int i = 0; i < 3; ++i)
+            {
+                float x = v[i].x(), y = v[i].y();
+                if (!(std::fabs(x) < guard_band && std::fabs(y) < guard_band))
+                    return false;
+                X[i] = std::llround(x * scale);
+                Y[i] = std::llround(y * scale);
+            }
+
+            int64_t area = (X[1] - X[0]) * (Y[2] - Y[0]) - (Y[1] - Y[0]) * (X[2] - X[0]);
+            if (area == 0)
+                return false;
+            // either winding is drawn, the edges are flipped to face inwards
+            int64_t sign = area > 0 ? 1 : -1;
+
+            const int64_t half = 1 << (subpixel_bits - 1);
+            for (int i = 0; i < 3; ++i)
+            {
+                int j = (i + 1) % 3, k = (i + 2) % 3;
+                int64_t a = sign * (Y[j] - Y[k]);
+                int64_t b = sign * (X[k] - X[j]);
+
+                // Of two triangles sharing an edge, one sees it with a > 0
+                // or, when it is horizontal, with b < 0
+                bias[i] = (a > 0 || (a == 0 && b < 0)) ? 0 : 1;
+                origin[i] = a * (half - X[j]) + b * (half - Y[j]) - bias[i];
+                step_x[i] = a * (1 << subpixel_bits);
+                step_y[i] = b * (1 << subpixel_bits);
+                for (int lane = 0; lane < block_size; ++lane)
+                    lane_x[i][lane] = lane * step_x[i];
+            }
+            inv_area = 1.0 / double(area * sign);
+            return true;
+        }
+
+        // The plane through the values a0, a1, a2 at the three vertices
+        plane_equation plane(float a0, float a1, float a2) const
+        {
+            const float a[3] = { a0, a1, a2 };
+            plane_equation p = { 0, 0, 0 };
+            for (int i = 0; i < 3; ++i)
+            {
+                p.c += double(origin[i] + bias[i]) * inv_area * a[i];
+                p.dx += double(step_x[i]) * inv_area * a[i];
+                p.dy += double(step_y[i]) * inv_area * a[i];
+            }
+            return p;
+        }
+
+        // Calls shade(x, y, alpha, beta, gamma) for every covered pixel in
+        // [x0, x1) x [y0, y1), where x0 and y0 are not negative
+        template <typename Shade>
+        void rasterize(int x0, int y0, int x1, int y1, Shade&& shade) const
+        {
+            rasterize(x0, y0, x1, y1, shade, [](int, int) { return true; });
+        }
+
+        // As above, but the blocks the triangle overlaps are first passed
+        // to visit(bx, by), which may skip them by returning false
+        template <typename Shade, typename Visit>
+        void rasterize(int x0, int y0, int x1, int y1, Shade&& shade, Visit&& visit) const
+        {
+            for (int by = y0 - y0 % block_size; by < y1; by += block_size)
+            {
+                for (int bx = x0 - x0 % block_size; bx < x1; bx += block_size)
+                {
+                    int64_t e[3];
+                    bool outside = false, inside = true;
+                    for (int i = 0; i < 3; ++i)
+                    {
+                        e[i] = origin[i] + bx * step_x[i] + by * step_y[i];
+                        int64_t dx = step_x[i] * (block_size - 1);
+                        int64_t dy = step_y[i] * (block_size - 1);
+                        int64_t best = e[i] + std::max<int64_t>(dx, 0) + std::max<int64_t>(dy, 0);
+                        int64_t worst = e[i] + std::min<int64_t>(dx, 0) + std::min<int64_t>(dy, 0);
+                        outside = outside || best < 0;
+                        inside = inside && worst >= 0;
+                    }
+                    if (outside || !visit(bx, by))
+                        continue;
+
+                    // the part of the block inside the rect
+                    int cx0 = std::max(x0 - bx, 0), cx1 = std::min(x1 - bx, block_size);
+                    int cy0 = std::max(y0 - by, 0), cy1 = std::min(y1 - by, block_size);
+                    int columns = ((1 << cx1) - 1) & ~((1 << cx0) - 1);
+
+                    for (int row = cy0; row < cy1; ++row)
+                    {
+                        int64_t r[3] = {
+                                e[0] + row * step_y[0],
+                                e[1] + row * step_y[1],
+                                e[2] + row * step_y[2]
+                        };
+                        int mask = (inside ? 0xFF : row_mask(r)) & columns;
+                        for (int k = 0; mask != 0; ++k, mask >>= 1)
+                        {
+                            if ((mask & 1) == 0)
+                                continue;
+                            float alpha = float(double(r[0] + lane_x[0][k] + bias[0]) * inv_area);
+                            float beta = float(double(r[1] + lane_x[1][k] + bias[1]) * inv_area);
+                            float gamma = float(double(r[2] + lane_x[2][k] + bias[2]) * inv_area);
+                            shade(bx + k, by + row, alpha, beta, gamma);
+                        }
+                    }
+                }
+            }
+        }
+
+        // Multisampled coverage. Sample s of a pixel lies offsets[s] sixteenths
+        // of a pixel from its centre. Calls shade(x, y, mask, alpha, beta,
+        // gamma) for every pixel in [x0, x1) x [y0, y1) with a covered
+        // sample, where bit s of mask is set if sample s is covered and alpha,
+        // beta and gamma are the weights at the pixel centre, which may lie
+        // outside the triangle.
+        template <int Samples, typename Shade>
+        void rasterize_samples(int x0, int y0, int x1, int y1, const int (&offsets)[Samples][2], Shade&& shade) const
+        {
+            // Subpixels are 1/256 pixel, so the offsets are exact
+            int64_t sample_offset[3][Samples];
+            int64_t reach[3];
+            for (int i = 0; i < 3; ++i)
+            {
+                reach[i] = 0;
+                for (int s = 0; s < Samples; ++s)
+                {
+                    sample_offset[i][s] = (step_x[i] * offsets[s][0] + step_y[i] * offsets[s][1]) / 16;
+                    reach[i] = std::max<int64_t>(reach[i], std::abs(sample_offset[i][s]));
+                }
+            }
+            constexpr int all_samples = (1 << Samples) - 1;
+
+            for (int by = y0 - y0 % block_size; by < y1; by += block_size)
+            {
+                for (int bx = x0 - x0 % block_size; bx < x1; bx += block_size)
+                {
+                    // As in rasterize, with the corners widened by how far a
+                    // sample moves the edge values from the pixel centre's
+                    int64_t e[3];
+                    bool outside = false, inside = true;
+                    for (int i = 0; i < 3; ++i)
+                    {
+                        e[i] = origin[i] + bx * step_x[i] + by * step_y[i];
+                        int64_t dx = step_x[i] * (block_size - 1);
+                        int64_t dy = step_y[i] * (block_size - 1);
+                        int64_t best = e[i] + std::max<int64_t>(dx, 0) + std::max<int64_t>(dy, 0) + reach[i];
+                        int64_t worst = e[i] + std::min<int64_t>(dx, 0) + std::min<int64_t>(dy, 0) - reach[i];
+                        outside = outside || best < 0;
+                        inside = inside && worst >= 0;
+                    }
+                    if (outside)
+                        continue;
+
+                    int cx0 = std::max(x0 - bx, 0), cx1 = std::min(x1 - bx, block_size);
+                    int cy0 = std::max(y0 - by, 0), cy1 = std::min(y1 - by, block_size);
+                    for (int row = cy0; row < cy1; ++row)
+                    {
+                        for (int k = cx0; k < cx1; ++k)
+                        {
+                            int64_t c[3];
+                            for (int i = 0; i < 3; ++i)
+                                c[i] = e[i] + row * step_y[i] + lane_x[i][k];
+
+                            int mask = all_samples;
+                            if (!inside)
+                            {
+                                mask = 0;
+                                for (int s = 0; s < Samples; ++s)
+                                {
+                                    if (((c[0] + sample_offset[0][s]) | (c[1] + sample_offset[1][s]) |
+                                         (c[2] + sample_offset[2][s])) >= 0)
+                                        mask |= 1 << s;
+                                }
+                                if (mask == 0)
+                                    continue;
+                            }
+                            float alpha = float(double(c[0] + bias[0]) * inv_area);
+                            float beta = float(double(c[1] + bias[1]) * inv_area);
+                            float gamma = float(double(c[2] + bias[2]) * inv_area);
+                            shade(bx + k, by + row, mask, alpha, beta, gamma);
+                        }
+                    }
+                }
+            }
+        }
+
+    private:
+        // Bit k is set if pixel k of the row starting with edge values e is
+        // covered, i.e. no edge value is negative there
+        int row_mask(const int64_t* e) const
+        {
+#if defined(RST_EDGE_AVX2)
+            int outside = 0;
+            for (int lane = 0; lane < block_size; lane += 4)
+            {
+                __m256i any = _mm256_setzero_si256();
+                for (int i = 0; i < 3; ++i)
+                {
+                    __m256i offsets = _mm256_loadu_si256((const __m256i*)&lane_x[i][lane]);
+                    any = _mm256_or_si256(any, _mm256_add_epi64(_mm256_set1_epi64x(e[i]), offsets));
+                }
+                outside |= _mm256_movemask_pd(_mm256_castsi256_pd(any)) << lane;
+            }
+            return ~outside & 0xFF;
+#elif defined(RST_EDGE_SSE)
+            int outside = 0;
+            for (int lane = 0; lane < block_size; lane += 2)
+            {
+                __m128i any = _mm_setzero_si128();
+                for (int i = 0; i < 3; ++i)
+                {
+                    __m128i offsets = _mm_loadu_si128((const __m128i*)&lane_x[i][lane]);
+                    any = _mm_or_si128(any, _mm_add_epi64(_mm_set1_epi64x(e[i]), offsets));
+                }
+                outside |= _mm_movemask_pd(_mm_castsi128_pd(any)) << lane;
+            }
+            return ~outside & 0xFF;
+#else
+            int mask = 0;
+            for (int lane = 0; lane < block_size; ++lane)
+            {
+                if (((e[0] + lane_x[0][lane]) | (e[1] + lane_x[1][lane]) | (e[2] + lane_x[2][lane])) >= 0)
+                    mask |= 1 << lane;
+            }
+            return mask;
+#endif
+        }
+    };
+}
@@ -89,11 +89,21 @@ int main(int argc, const char** argv)
     float angle = 0;
     bool command_line = false;
     std::string filename = "output.png";
+    // "wireframe" draws the edges of the triangles instead of filling them
+    rst::Primitive primitive = rst::Primitive::Triangle;
 
-    if (argc == 2)
+    for (int i = 1; i < argc; ++i)
     {
-        command_line = true;
-        filename = std::string(argv[1]);
+        std::string arg = argv[i];
+        if (arg == "wireframe")
+        {
+            primitive = rst::Primitive::Line;
+        }
+        else
+        {
+            command_line = true;
+            filename = arg;
+        }
     }
 
     rst::rasterizer r(700, 700);
@@ -142,7 +152,7 @@ int main(int argc, const char** argv)
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
 
-        r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
+        r.draw(pos_id, ind_id, col_id, primitive);
         cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
         image.convertTo(image, CV_8UC3, 1.0f);
         cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
@@ -160,7 +170,7 @@ int main(int argc, const char** argv)
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
 
-        r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
+        r.draw(pos_id, ind_id, col_id, primitive);
 
         cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
         image.convertTo(image, CV_8UC3, 1.0f);
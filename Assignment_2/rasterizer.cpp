@@ -6,32 +6,41 @@
 #include <algorithm>
 #include <vector>
 #include "rasterizer.hpp"
+#include "EdgeFunction.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
 
 
-rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
+rst::pos_buf_id rst::rasterizer::load_positions(std::vector<Eigen::Vector3f> positions)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
+    return {pos_buf.add(std::move(positions))};
+}
 
-    return {id};
+rst::pos_buf_id rst::rasterizer::load_positions(buffer_span<Eigen::Vector3f> positions)
+{
+    return {pos_buf.adopt(positions)};
 }
 
-rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+rst::ind_buf_id rst::rasterizer::load_indices(std::vector<Eigen::Vector3i> indices)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
+    edge_buf.add(unique_edges(indices.data(), indices.size()));
+    return {ind_buf.add(std::move(indices))};
+}
 
-    return {id};
+rst::ind_buf_id rst::rasterizer::load_indices(buffer_span<Eigen::Vector3i> indices)
+{
+    edge_buf.add(unique_edges(indices.data, indices.count));
+    return {ind_buf.adopt(indices)};
 }
 
-rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
+rst::col_buf_id rst::rasterizer::load_colors(std::vector<Eigen::Vector3f> cols)
 {
-    auto id = get_next_id();
-    col_buf.emplace(id, cols);
+    return {col_buf.add(std::move(cols))};
+}
 
-    return {id};
+rst::col_buf_id rst::rasterizer::load_colors(buffer_span<Eigen::Vector3f> cols)
+{
+    return {col_buf.adopt(cols)};
 }
 
 auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
@@ -40,7 +49,7 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
 }
 
 
-static bool insideTriangle(int x, int y, const Vector3f* _v)
+static bool insideTriangle(float x, float y, const Vector3f* _v)
 {   
     // TODO : Implement this function to check if the point (x, y) is inside the triangle represented by _v[0], _v[1], _v[2]
     // Assuem it's counter clockwise;
@@ -58,19 +67,18 @@ static bool insideTriangle(int x, int y, const Vector3f* _v)
     
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector3f* v)
-{
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
-}
-
 void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
 {
-    auto& buf = pos_buf[pos_buffer.pos_id];
-    auto& ind = ind_buf[ind_buffer.ind_id];
-    auto& col = col_buf[col_buffer.col_id];
+    buffer_span<Eigen::Vector3f> buf = pos_buf[pos_buffer.pos_id];
+    if (type == Primitive::Line)
+    {
+        draw_wireframe(buf, edge_buf[ind_buffer.ind_id]);
+        resolve();
+        return;
+    }
+
+    buffer_span<Eigen::Vector3i> ind = ind_buf[ind_buffer.ind_id];
+    buffer_span<Eigen::Vector3f> col = col_buf[col_buffer.col_id];
 
     float f1 = (50 - 0.1) / 2.0;
     float f2 = (50 + 0.1) / 2.0;
@@ -113,15 +121,104 @@ void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf
 
         rasterize_triangle(t);
     }
+
+    resolve();
 }
-float interpolate(float x, float y, const Triangle& t)
+
+void rst::rasterizer::draw_wireframe(buffer_span<Eigen::Vector3f> positions, buffer_span<mesh_edge> edges)
 {
-    auto v = t.toVector4();
-    auto [alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-    float w_reciprocal = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-    float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-    z_interpolated *= w_reciprocal;
-    return z_interpolated;
+    Eigen::Matrix4f mvp = projection * view * model;
+    near_plane near(projection);
+
+    vertices.resize(positions.size());
+    for (size_t i = 0; i < positions.size(); ++i)
+        vertices[i] = project_vertex(mvp * to_vec4(positions[i], 1.0f), near, width, height);
+
+    // Rows are split into a band per worker. The segments are clipped and
+    // binned by the bands they cross here, as the dirty rect is not shared
+    // between threads, and each worker draws its band of rows.
+    int bands = pool ? (int)pool->size() : 1;
+    auto band_begin = [&](int band) { return height * band / bands; };
+    bins.resize(bands);
+    for (auto& bin : bins)
+        bin.clear();
+    for (const mesh_edge& edge : edges)
+    {
+        line_segment line;
+        if (!project_edge(vertices[edge.a], vertices[edge.b], near, width, height, line))
+            continue;
+        int y0 = std::min(line.y0, line.y1), y1 = std::max(line.y0, line.y1);
+        mark_dirty(std::min(line.x0, line.x1), y0, std::max(line.x0, line.x1) + 1, y1 + 1);
+        int band = (int)((long long)y0 * bands / height);
+        while (band + 1 < bands && band_begin(band + 1) <= y0)
+            ++band;
+        for (; band < bands && band_begin(band) <= y1; ++band)
+            bins[band].push_back(line);
+    }
+
+    // Row 0 of sample_buf is the top of the screen
+    const Eigen::Vector3f line_color = {255, 255, 255};
+    pixel_samples* origin = sample_buf.data() + size_t(height - 1) * width;
+    auto draw_band = [&](int band)
+    {
+        for (const line_segment& line : bins[band])
+        {
+            draw_segment(origin, 1, -width, line, band_begin(band), band_begin(band + 1), [&](pixel_samples& pixel) {
+                std::fill(std::begin(pixel.color), std::end(pixel.color), line_color);
+            });
+        }
+    };
+    if (bands == 1)
+    {
+        draw_band(0);
+        return;
+    }
+
+    std::vector<std::future<void>> done;
+    for (int band = 0; band < bands; ++band)
+        done.push_back(pool->submit([&, band] { draw_band(band); }));
+    for (auto& d : done)
+        d.get();
+}
+
+void rst::rasterizer::resolve()
+{
+    // Outside the dirty rect every sample is cleared, as is frame_buf
+    int rows = dirty_row1 - dirty_row0;
+    if (rows <= 0 || dirty_x0 >= dirty_x1)
+        return;
+
+    auto resolve_rows = [this](int begin, int end)
+    {
+        for (int row = begin; row < end; ++row)
+        {
+            for (int index = row * width + dirty_x0; index < row * width + dirty_x1; ++index)
+            {
+                const pixel_samples& pixel = sample_buf[index];
+                Eigen::Vector3f sum = pixel.color[0];
+                for (int s = 1; s < samples; ++s)
+                    sum += pixel.color[s];
+                frame_buf[index] = sum / samples;
+            }
+        }
+    };
+
+    // Bands of rows, several per worker so uneven bands balance out
+    int bands = pool ? std::min(rows, (int)pool->size() * 4) : 1;
+    if (bands == 1)
+    {
+        resolve_rows(dirty_row0, dirty_row1);
+        return;
+    }
+
+    std::vector<std::future<void>> done;
+    for (int band = 0; band < bands; ++band)
+    {
+        int begin = dirty_row0 + rows * band / bands, end = dirty_row0 + rows * (band + 1) / bands;
+        done.push_back(pool->submit([=] { resolve_rows(begin, end); }));
+    }
+    for (auto& d : done)
+        d.get();
 }
 //Screen space rasterization
 void rst::rasterizer::rasterize_triangle(const Triangle& t) {
@@ -141,30 +238,73 @@ void rst::rasterizer::rasterize_triangle(const Triangle& t) {
         b = std::min(v[i].y(), b);
         u = std::max(v[i].y(), u);
     }
-    // iterate through the pixel and find if the current pixel is inside the triangle
-    for (int i = std::floor(l); i < r && i < width ; i++)
+
+    using pattern = sample_pattern<samples>;
+
+    // Depth is linear in screen space, set up once per triangle
+    triangle_edges edges;
+    bool fixed_point = edges.setup(t.v);
+    plane_equation depth = edges.plane(v[0].z(), v[1].z(), v[2].z());
+    if (!fixed_point)
+    {
+        // the plane through the vertices, without the edge setup
+        Vector3f n = (t.v[1] - t.v[0]).cross(t.v[2] - t.v[0]);
+        if (n.z() == 0)
+            return;
+        depth.dx = -n.x() / n.z();
+        depth.dy = -n.y() / n.z();
+        depth.c = t.v[0].z() + (0.5 - t.v[0].x()) * depth.dx + (0.5 - t.v[0].y()) * depth.dy;
+    }
+
+    // Shades pixel (i, j) once and writes the color to the samples in mask
+    // that pass the depth test. The color is flat, so the weights at the
+    // pixel centre go unused.
+    auto shade = [&](int i, int j, int mask, float, float, float)
+    {
+        Eigen::Vector3f color = t.getColor();
+        pixel_samples& pixel = sample_buf[get_index(i, j)];
+        for (int s = 0; s < samples; ++s)
+        {
+            if ((mask >> s & 1) == 0)
+                continue;
+            float z = depth.at(i + pattern::offset[s][0] / 16.0, j + pattern::offset[s][1] / 16.0);
+            if (z < pixel.depth[s])
+            {
+                pixel.depth[s] = z;
+                pixel.color[s] = color;
+            }
+        }
+    };
+
+    // The pixels floor(l) <= i < r and floor(b) <= j < u on screen, walked
+    // with the edge equations set up once per triangle
+    int i0 = std::max(0, (int)std::floor(l)), i1 = std::min(width, (int)std::ceil(r));
+    int j0 = std::max(0, (int)std::floor(b)), j1 = std::min(height, (int)std::ceil(u));
+    if (i0 >= i1 || j0 >= j1)
+        return;
+    mark_dirty(i0, j0, i1, j1);
+    if (fixed_point)
+    {
+        edges.rasterize_samples(i0, j0, i1, j1, pattern::offset, shade);
+        return;
+    }
+
+    // Vertices too far out for the fixed point setup, test every sample
+    for (int i = i0; i < i1; i++)
     {
-        for (int j = std::floor(b); j < u && j < height; j++)
+        for (int j = j0; j < j1; j++)
         {
             // For pixel (i,j), it's centre is (i+0.5, j+0.5);
             float x = i + 0.5f, y = j + 0.5f;   // centre coordinate
 
-            Vector3f point(i, j, 0);        // For set_pixel();
-
-            // What about anti-aliasing?
-            // super-sampling :
-            
-            
-            if (insideTriangle(x,y,t.v))  
+            int mask = 0;
+            for (int s = 0; s < samples; ++s)
             {
-                float z_interpolated = interpolate(x, y, t);
-                // Now we get the depth values of (i,j) pixel
-                if (z_interpolated < depth_buf[get_index(i,j)])  
-                {
-                    depth_buf[get_index(i,j)] = z_interpolated;
-                    set_pixel(point, t.getColor());
-                }
+                if (insideTriangle(x + pattern::offset[s][0] / 16.0f, y + pattern::offset[s][1] / 16.0f, t.v))
+                    mask |= 1 << s;
             }
+            if (mask != 0)
+                shade(i, j, mask, 0, 0, 0);
         }
     }
     // If so, use the following code to get the interpolated z value.
@@ -195,20 +335,38 @@ void rst::rasterizer::set_projection(const Eigen::Matrix4f& p)
 
 void rst::rasterizer::clear(rst::Buffers buff)
 {
-    if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
+    bool color = (buff & rst::Buffers::Color) == rst::Buffers::Color;
+    bool depth = (buff & rst::Buffers::Depth) == rst::Buffers::Depth;
+    if (color)
     {
         std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
     }
-    if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
+    for (int row = dirty_row0; row < dirty_row1; ++row)
     {
-        std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        for (int index = row * width + dirty_x0; index < row * width + dirty_x1; ++index)
+        {
+            pixel_samples& pixel = sample_buf[index];
+            if (color)
+                std::fill(std::begin(pixel.color), std::end(pixel.color), Eigen::Vector3f{0, 0, 0});
+            if (depth)
+                std::fill(std::begin(pixel.depth), std::end(pixel.depth), std::numeric_limits<float>::infinity());
+        }
     }
+    if (color && depth)
+        dirty_x0 = dirty_x1 = dirty_row0 = dirty_row1 = 0;
 }
 
 rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
     frame_buf.resize(w * h);
-    depth_buf.resize(w * h);
+    sample_buf.resize(w * h);
+    // every sample is visited by the first clear
+    mark_dirty(0, 0, w, h);
+    clear(Buffers::Color | Buffers::Depth);
+
+    unsigned int threads = std::thread::hardware_concurrency();
+    if (threads > 1)
+        pool = std::make_unique<ThreadPool>(threads);
 }
 
 int rst::rasterizer::get_index(int x, int y)
@@ -216,11 +374,33 @@ int rst::rasterizer::get_index(int x, int y)
     return (height-1-y)*width + x;
 }
 
+void rst::rasterizer::mark_dirty(int x0, int y0, int x1, int y1)
+{
+    // rows of sample_buf run from the top of the screen down
+    int row0 = height - y1, row1 = height - y0;
+    if (dirty_x0 >= dirty_x1 || dirty_row0 >= dirty_row1)
+    {
+        dirty_x0 = x0;
+        dirty_x1 = x1;
+        dirty_row0 = row0;
+        dirty_row1 = row1;
+        return;
+    }
+    dirty_x0 = std::min(dirty_x0, x0);
+    dirty_x1 = std::max(dirty_x1, x1);
+    dirty_row0 = std::min(dirty_row0, row0);
+    dirty_row1 = std::max(dirty_row1, row1);
+}
+
 void rst::rasterizer::set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color)
 {
     //old index: auto ind = point.y() + point.x() * width;
     auto ind = (height-1-point.y())*width + point.x();
     frame_buf[ind] = color;
+    // every sample, so the pixel keeps its color through the next resolve
+    int x = point.x(), y = point.y();
+    mark_dirty(x, y, x + 1, y + 1);
+    std::fill(std::begin(sample_buf[ind].color), std::end(sample_buf[ind].color), color);
 
 }
 
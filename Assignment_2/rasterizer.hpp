@@ -6,10 +6,19 @@
 
 #include <Eigen/Eigen>
 #include <algorithm>
+#include <memory>
 #include "global.hpp"
 #include "Triangle.hpp"
+#include "BufferStore.hpp"
+#include "ThreadPool.hpp"
+#include "Wireframe.hpp"
 using namespace Eigen;
 
+// Samples per pixel, 1, 2 or 4. Set with -DRST_MSAA_SAMPLES=n.
+#ifndef RST_MSAA_SAMPLES
+#define RST_MSAA_SAMPLES 4
+#endif
+
 namespace rst
 {
     enum class Buffers
@@ -54,13 +63,43 @@ namespace rst
         int col_id = 0;
     };
 
+    // Sample positions of a pixel, in sixteenths of a pixel from its centre.
+    // 2x and 4x are rotated grids: no two samples share a row or a column,
+    // so edges close to horizontal or vertical get a coverage step per
+    // sample.
+    template <int Samples>
+    struct sample_pattern;
+
+    template <>
+    struct sample_pattern<1>
+    {
+        static constexpr int offset[1][2] = {{0, 0}};
+    };
+
+    template <>
+    struct sample_pattern<2>
+    {
+        static constexpr int offset[2][2] = {{4, 4}, {-4, -4}};
+    };
+
+    template <>
+    struct sample_pattern<4>
+    {
+        static constexpr int offset[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+    };
+
     class rasterizer
     {
     public:
         rasterizer(int w, int h);
-        pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
-        ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
-        col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
+        // Copies the buffer, or takes it over when it is moved in
+        pos_buf_id load_positions(std::vector<Eigen::Vector3f> positions);
+        ind_buf_id load_indices(std::vector<Eigen::Vector3i> indices);
+        col_buf_id load_colors(std::vector<Eigen::Vector3f> colors);
+        // Draws from the caller's memory, which must outlive the draws
+        pos_buf_id load_positions(buffer_span<Eigen::Vector3f> positions);
+        ind_buf_id load_indices(buffer_span<Eigen::Vector3i> indices);
+        col_buf_id load_colors(buffer_span<Eigen::Vector3f> colors);
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
@@ -70,15 +109,25 @@ namespace rst
 
         void clear(Buffers buff);
 
+        // Primitive::Line draws the edges of the triangles in white, each
+        // edge shared by several triangles once, and ignores the colors
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
 
+        // The resolved image, updated by draw
         std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
 
+        static constexpr int samples = RST_MSAA_SAMPLES;
+        static_assert(samples == 1 || samples == 2 || samples == 4, "RST_MSAA_SAMPLES must be 1, 2 or 4");
+
     private:
-        void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
+        // Writes the visible part of every edge to all samples of its pixels
+        void draw_wireframe(buffer_span<Eigen::Vector3f> positions, buffer_span<mesh_edge> edges);
 
         void rasterize_triangle(const Triangle& t);
 
+        // Averages the samples of every pixel into frame_buf
+        void resolve();
+
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
     private:
@@ -86,21 +135,41 @@ namespace rst
         Eigen::Matrix4f view;
         Eigen::Matrix4f projection;
 
-        std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-        std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> col_buf;
+        buffer_store<Eigen::Vector3f> pos_buf;
+        buffer_store<Eigen::Vector3i> ind_buf;
+        buffer_store<Eigen::Vector3f> col_buf;
+        // the unique edges of each index buffer, loaded with the same id
+        buffer_store<mesh_edge> edge_buf;
+        // reused by every wireframe draw: the projected positions, and
+        // bins[band] the visible segments that cross a band of rows
+        std::vector<wire_vertex> vertices;
+        std::vector<std::vector<line_segment>> bins;
 
         std::vector<Eigen::Vector3f> frame_buf;
 
-        std::vector<float> depth_buf;
+        // Depth and color of each sample of a pixel, stored together. A
+        // triangle is shaded once per pixel, and the color is written to the
+        // samples it covers that pass the depth test.
+        struct pixel_samples
+        {
+            float depth[samples];
+            Eigen::Vector3f color[samples];
+        };
+        // indexed like frame_buf
+        std::vector<pixel_samples> sample_buf;
         int get_index(int x, int y);
 
-        int width, height;
+        // The samples written since they were last cleared lie in columns
+        // [dirty_x0, dirty_x1) of rows [dirty_row0, dirty_row1) of
+        // sample_buf. Clears and the resolve only visit these.
+        int dirty_x0 = 0, dirty_x1 = 0;
+        int dirty_row0 = 0, dirty_row1 = 0;
+        // Adds the pixels [x0, x1) x [y0, y1) to the dirty rect
+        void mark_dirty(int x0, int y0, int x1, int y1);
 
-        int next_id = 0;
-        int get_next_id() { return next_id++; }
+        int width, height;
 
-        std::vector<Vector4f> ssaa_depth_buf;
-        std::vector<std::vector<Eigen::Vector3f>> ssaa_frame_buf;
+        // Runs the resolve and the wireframe bands, null on a single core
+        std::unique_ptr<ThreadPool> pool;
     };
 }
@@ -0,0 +1,332 @@
+// BinaryMesh.hpp - Compact binary meshes for the OBJ Model Loader
+//
+// A .mesh file holds one indexed triangle mesh, written once from an .obj
+// file by WriteBinaryMesh. Opening it maps the file and hands out spans
+// into the mapping, so nothing is parsed or copied.
+
+#pragma once
+
+#include "OBJ_Loader.h"
+#include <limits>
+
+namespace objl
+{
+    // Structure: Span
+    //
+    // Description: Read only view of an array owned by someone else
+    template <class T>
+    struct Span
+    {
+        const T* Data = nullptr;
+        size_t Count = 0;
+
+        const T* begin() const
+        {
+            return Data;
+        }
+        const T* end() const
+        {
+            return Data + Count;
+        }
+        size_t size() const
+        {
+            return Count;
+        }
+        bool empty() const
+        {
+            return Count == 0;
+        }
+        const T& operator[](size_t i) const
+        {
+            return Data[i];
+        }
+    };
+
+    // Structure: BinaryMeshHeader
+    //
+    // Description: Start of a .mesh file. The arrays follow at the given
+    //	byte offsets, each aligned to BinaryMeshAlignment: positions and
+    //	normals as three floats, texture coordinates as two floats and
+    //	the indices as uint32_t, three per triangle. Everything is stored
+    //	little endian.
+    struct BinaryMeshHeader
+    {
+        char Magic[8];
+        uint32_t Version;
+        uint32_t HeaderSize;
+        uint64_t FileSize;
+
+        uint64_t VertexCount;
+        uint64_t IndexCount;
+
+        uint64_t PositionOffset;
+        uint64_t NormalOffset;
+        uint64_t TexCoordOffset;
+        uint64_t IndexOffset;
+
+        float BoundsMin[3];
+        float BoundsMax[3];
+
+        // FNV-1a over the 64 bit words from HeaderSize to FileSize
+        uint64_t ContentHash;
+    };
+
+    static constexpr char BinaryMeshMagic[8] = { 'O', 'B', 'J', 'L', 'M', 'E', 'S', 'H' };
+    static constexpr uint32_t BinaryMeshVersion = 1;
+    static constexpr uint64_t BinaryMeshAlignment = 64;
+
+    static_assert(sizeof(Vector3) == 3 * sizeof(float) && sizeof(Vector2) == 2 * sizeof(float),
+                  "vectors are read straight from the file");
+
+    namespace algorithm
+    {
+        // Hash of a .mesh file body, its size is a multiple of 8
+        inline uint64_t hashMeshBody(const char* begin, const char* end)
+        {
+            uint64_t hash = 14695981039346656037ull;
+            for (const char* p = begin; p + 8 <= end; p += 8)
+            {
+                uint64_t word;
+                std::memcpy(&word, p, 8);
+                hash = (hash ^ word) * 1099511628211ull;
+            }
+            return hash;
+        }
+
+        // Whether Path ends with the given extension
+        inline bool hasExtension(const std::string& Path, const std::string& Extension)
+        {
+            return Path.size() >= Extension.size() &&
+                   Path.compare(Path.size() - Extension.size(), Extension.size(), Extension) == 0;
+        }
+    }
+
+    // Write Vertices and Indices as a .mesh file
+    //
+    // If the file is written return true
+    inline bool WriteBinaryMesh(const std::string& Path,
+                                const std::vector<Vertex>& Vertices,
+                                const std::vector<unsigned int>& Indices)
+    {
+        auto align = [](uint64_t offset)
+        {
+            return (offset + BinaryMeshAlignment - 1) / BinaryMeshAlignment * BinaryMeshAlignment;
+        };
+
+        BinaryMeshHeader header = {};
+        std::memcpy(header.Magic, BinaryMeshMagic, sizeof(header.Magic));
+        header.Version = BinaryMeshVersion;
+        header.HeaderSize = uint32_t(align(sizeof(BinaryMeshHeader)));
+        header.VertexCount = Vertices.size();
+        header.IndexCount = Indices.size();
+        header.PositionOffset = header.HeaderSize;
+        header.NormalOffset = align(header.PositionOffset + Vertices.size() * sizeof(Vector3));
+        header.TexCoordOffset = align(header.NormalOffset + Vertices.size() * sizeof(Vector3));
+        header.IndexOffset = align(header.TexCoordOffset + Vertices.size() * sizeof(Vector2));
+        header.FileSize = align(header.IndexOffset + Indices.size() * sizeof(uint32_t));
+
+        for (int i = 0; i < 3; i++)
+        {
+            header.BoundsMin[i] = Vertices.empty() ? 0.0f : std::numeric_limits<float>::infinity();
+            header.BoundsMax[i] = Vertices.empty() ? 0.0f : -std::numeric_limits<float>::infinity();
+        }
+
+        std::vector<char> file(header.FileSize, 0);
+        char* positions = file.data() + header.PositionOffset;
+        char* normals = file.data() + header.NormalOffset;
+        char* texcoords = file.data() + header.TexCoordOffset;
+        for (const Vertex& vertex : Vertices)
+        {
+            const float position[3] = { vertex.Position.X, vertex.Position.Y, vertex.Position.Z };
+            for (int i = 0; i < 3; i++)
+            {
+                header.BoundsMin[i] = std::min(header.BoundsMin[i], position[i]);
+                header.BoundsMax[i] = std::max(header.BoundsMax[i], position[i]);
+            }
+
+            std::memcpy(positions, &vertex.Position, sizeof(Vector3));
+            std::memcpy(normals, &vertex.Normal, sizeof(Vector3));
+            std::memcpy(texcoords, &vertex.TextureCoordinate, sizeof(Vector2));
+            positions += sizeof(Vector3);
+            normals += sizeof(Vector3);
+            texcoords += sizeof(Vector2);
+        }
+        for (size_t i = 0; i < Indices.size(); i++)
+        {
+            uint32_t index = Indices[i];
+            std::memcpy(file.data() + header.IndexOffset + i * sizeof(uint32_t), &index, sizeof(uint32_t));
+        }
+
+        header.ContentHash = algorithm::hashMeshBody(file.data() + header.HeaderSize, file.data() + file.size());
+        std::memcpy(file.data(), &header, sizeof(header));
+
+        std::ofstream out(Path, std::ios::binary);
+        out.write(file.data(), std::streamsize(file.size()));
+        return bool(out);
+    }
+
+    // Write all meshes of a loader as one .mesh file
+    inline bool WriteBinaryMesh(const std::string& Path, const Loader& loader)
+    {
+        return WriteBinaryMesh(Path, loader.LoadedVertices, loader.LoadedIndices);
+    }
+
+    // Class: BinaryMesh
+    //
+    // Description: An indexed triangle mesh, either mapped from a .mesh
+    //	file or loaded from an .obj file with all its meshes merged.
+    //	The spans stay valid as long as the BinaryMesh lives.
+    class BinaryMesh
+    {
+    public:
+        BinaryMesh()
+        {
+
+        }
+        BinaryMesh(const BinaryMesh&) = delete;
+        BinaryMesh& operator=(const BinaryMesh&) = delete;
+
+        // Map .mesh files, parse anything else as an .obj file
+        //
+        // If the mesh is loaded return true
+        bool Load(const std::string& Path)
+        {
+            if (algorithm::hasExtension(Path, ".mesh"))
+                return Open(Path);
+
+            Loader loader;
+            if (!loader.LoadFile(Path))
+                return false;
+
+            Close();
+            size_t count = loader.LoadedVertices.size();
+            ownedPositions.resize(count);
+            ownedNormals.resize(count);
+            ownedTexCoords.resize(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                ownedPositions[i] = loader.LoadedVertices[i].Position;
+                ownedNormals[i] = loader.LoadedVertices[i].Normal;
+                ownedTexCoords[i] = loader.LoadedVertices[i].TextureCoordinate;
+            }
+            ownedIndices.assign(loader.LoadedIndices.begin(), loader.LoadedIndices.end());
+
+            Positions = { ownedPositions.data(), count };
+            Normals = { ownedNormals.data(), count };
+            TexCoords = { ownedTexCoords.data(), count };
+            Indices = { ownedIndices.data(), ownedIndices.size() };
+
+            if (count > 0)
+            {
+                BoundsMin = BoundsMax = ownedPositions[0];
+                for (const Vector3& p : ownedPositions)
+                {
+                    BoundsMin = Vector3(std::min(BoundsMin.X, p.X), std::min(BoundsMin.Y, p.Y), std::min(BoundsMin.Z, p.Z));
+                    BoundsMax = Vector3(std::max(BoundsMax.X, p.X), std::max(BoundsMax.Y, p.Y), std::max(BoundsMax.Z, p.Z));
+                }
+            }
+            return true;
+        }
+
+        // Map a .mesh file. Only the header is checked, Verify reads
+        //	the whole file.
+        //
+        // If the file is missing, of another version or truncated
+        // return false
+        bool Open(const std::string& Path)
+        {
+            Close();
+            if (!file.Open(Path) || file.Size() < sizeof(BinaryMeshHeader))
+                return Close();
+
+            BinaryMeshHeader header;
+            std::memcpy(&header, file.Data(), sizeof(header));
+
+            auto fits = [&](uint64_t offset, uint64_t bytes)
+            {
+                return offset % BinaryMeshAlignment == 0 && offset >= header.HeaderSize &&
+                       offset <= header.FileSize && bytes <= header.FileSize - offset;
+            };
+            if (std::memcmp(header.Magic, BinaryMeshMagic, sizeof(header.Magic)) != 0 ||
+                header.Version != BinaryMeshVersion ||
+                header.HeaderSize < sizeof(BinaryMeshHeader) ||
+                header.FileSize != file.Size() || header.FileSize % 8 != 0 ||
+                header.VertexCount > header.FileSize || header.IndexCount > header.FileSize ||
+                header.IndexCount % 3 != 0 ||
+                !fits(header.PositionOffset, header.VertexCount * sizeof(Vector3)) ||
+                !fits(header.NormalOffset, header.VertexCount * sizeof(Vector3)) ||
+                !fits(header.TexCoordOffset, header.VertexCount * sizeof(Vector2)) ||
+                !fits(header.IndexOffset, header.IndexCount * sizeof(uint32_t)))
+                return Close();
+
+            const char* data = file.Data();
+            Positions = { (const Vector3*)(data + header.PositionOffset), size_t(header.VertexCount) };
+            Normals = { (const Vector3*)(data + header.NormalOffset), size_t(header.VertexCount) };
+            TexCoords = { (const Vector2*)(data + header.TexCoordOffset), size_t(header.VertexCount) };
+            Indices = { (const uint32_t*)(data + header.IndexOffset), size_t(header.IndexCount) };
+            BoundsMin = Vector3(header.BoundsMin[0], header.BoundsMin[1], header.BoundsMin[2]);
+            BoundsMax = Vector3(header.BoundsMax[0], header.BoundsMax[1], header.BoundsMax[2]);
+            ContentHash = header.ContentHash;
+            headerSize = header.HeaderSize;
+            return true;
+        }
+
+        // Check the content hash of a mapped file and that every index
+        //	is in range
+        bool Verify() const
+        {
+            if (file.Data() != nullptr &&
+                algorithm::hashMeshBody(file.Data() + headerSize, file.Data() + file.Size()) != ContentHash)
+                return false;
+            for (uint32_t index : Indices)
+                if (index >= Positions.size())
+                    return false;
+            return true;
+        }
+
+        // Whether the spans point into a mapped .mesh file
+        bool IsMapped() const
+        {
+            return file.Data() != nullptr;
+        }
+
+        // Vertex attributes, one entry per vertex
+        Span<Vector3> Positions;
+        Span<Vector3> Normals;
+        Span<Vector2> TexCoords;
+        // Three indices per triangle
+        Span<uint32_t> Indices;
+
+        Vector3 BoundsMin;
+        Vector3 BoundsMax;
+        // Hash of the file body, 0 for meshes loaded from .obj files
+        uint64_t ContentHash = 0;
+
+    private:
+        // Drop the current mesh, returns false for Open's failure paths
+        bool Close()
+        {
+            file.Close();
+            ownedPositions.clear();
+            ownedNormals.clear();
+            ownedTexCoords.clear();
+            ownedIndices.clear();
+            Positions = {};
+            Normals = {};
+            TexCoords = {};
+            Indices = {};
+            BoundsMin = BoundsMax = Vector3();
+            ContentHash = 0;
+            headerSize = 0;
+            return false;
+        }
+
+        MappedFile file;
+        size_t headerSize = 0;
+
+        std::vector<Vector3> ownedPositions;
+        std::vector<Vector3> ownedNormals;
+        std::vector<Vector2> ownedTexCoords;
+        std::vector<uint32_t> ownedIndices;
+    };
+}
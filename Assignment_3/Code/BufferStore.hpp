@@ -0,0 +1,73 @@
+//
+// Vertex and index buffers, addressed by typed handles.
+//
+// A handle is the index of its buffer's slot, so a draw finds the buffer
+// without a lookup. A buffer either owns its elements, copied or moved in
+// when it is loaded, or reads memory the caller owns. Moving or adopting
+// copies nothing, which matters for meshes of millions of vertices; adopted
+// memory has to stay alive and unchanged for as long as it is drawn.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace rst
+{
+    // Read only elements that some buffer or the caller owns
+    template <typename T>
+    struct buffer_span
+    {
+        const T* data = nullptr;
+        size_t count = 0;
+
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        const T& operator[](size_t i) const { return data[i]; }
+        const T* begin() const { return data; }
+        const T* end() const { return data + count; }
+    };
+
+    template <typename T>
+    class buffer_store
+    {
+    public:
+        // Takes over the storage of elements, which callers that keep their
+        // own vector pass as a copy
+        int add(std::vector<T> elements)
+        {
+            slots.emplace_back();
+            slots.back().owned = std::move(elements);
+            return int(slots.size()) - 1;
+        }
+
+        // Reads the caller's elements in place
+        int adopt(buffer_span<T> elements)
+        {
+            slots.emplace_back();
+            slots.back().adopted = elements;
+            slots.back().is_adopted = true;
+            return int(slots.size()) - 1;
+        }
+
+        // The elements of buffer id, none if no buffer was loaded as id
+        buffer_span<T> operator[](int id) const
+        {
+            if (id < 0 || id >= int(slots.size()))
+                return {};
+            const slot& s = slots[id];
+            return s.is_adopted ? s.adopted : buffer_span<T>{ s.owned.data(), s.owned.size() };
+        }
+
+    private:
+        struct slot
+        {
+            std::vector<T> owned;
+            buffer_span<T> adopted;
+            bool is_adopted = false;
+        };
+        std::vector<slot> slots;
+    };
+}
@@ -0,0 +1,153 @@
+//
+// Writes images on a background thread, so encoding them does not hold up
+// rendering. Frames wait in a bounded queue of buffers that are reused once
+// written, so no image is allocated per frame.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+class FrameWriter
+{
+public:
+    // What write does when every buffer is waiting to be written
+    enum class Policy
+    {
+        Block,  // waits for the oldest frame to be written, no frame is lost
+        Drop    // drops the new frame, so the caller never waits
+    };
+
+    explicit FrameWriter(size_t capacity = 4, Policy policy = Policy::Block)
+        : policy(policy), slots(std::max<size_t>(capacity, 1))
+    {
+        for (size_t i = 0; i < slots.size(); ++i)
+            free_slots.push_back(i);
+        worker = std::thread([this] { work(); });
+    }
+
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter& operator=(const FrameWriter&) = delete;
+
+    // Writes the frames still queued, then joins the worker
+    ~FrameWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queued.notify_all();
+        worker.join();
+    }
+
+    // Copies image, which may change as soon as this returns, and queues it
+    // to be written to path. False if the frame was dropped.
+    bool write(const std::string& path, const cv::Mat& image)
+    {
+        size_t slot;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (free_slots.empty() && policy == Policy::Drop)
+            {
+                ++dropped_frames;
+                return false;
+            }
+            freed.wait(lock, [this] { return !free_slots.empty(); });
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+
+        // The slot is ours until it is queued, so the copy needs no lock
+        image.copyTo(slots[slot].image);
+        slots[slot].path = path;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push(slot);
+        }
+        queued.notify_one();
+        return true;
+    }
+
+    // Waits until every queued frame is written
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        freed.wait(lock, [this] { return free_slots.size() == slots.size(); });
+    }
+
+    size_t dropped() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return dropped_frames;
+    }
+
+    // Frames cv::imwrite failed on
+    size_t failed() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return failed_frames;
+    }
+
+private:
+    struct frame
+    {
+        cv::Mat image;
+        std::string path;
+    };
+
+    void work()
+    {
+        for (;;)
+        {
+            size_t slot;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued.wait(lock, [this] { return stopping || !pending.empty(); });
+                if (pending.empty())
+                    return;
+                slot = pending.front();
+                pending.pop();
+            }
+
+            bool written;
+            try
+            {
+                written = cv::imwrite(slots[slot].path, slots[slot].image);
+            }
+            catch (const std::exception&)
+            {
+                written = false;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!written)
+                    ++failed_frames;
+                free_slots.push_back(slot);
+            }
+            freed.notify_all();
+        }
+    }
+
+    Policy policy;
+    std::vector<frame> slots;
+    // Slots ready to be filled, and filled slots in the order to write them
+    std::vector<size_t> free_slots;
+    std::queue<size_t> pending;
+    size_t dropped_frames = 0;
+    size_t failed_frames = 0;
+
+    mutable std::mutex mutex;
+    std::condition_variable queued;
+    std::condition_variable freed;
+    bool stopping = false;
+    std::thread worker;
+};
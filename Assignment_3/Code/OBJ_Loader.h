@@ -18,6 +18,29 @@
 #include <string>
 #include <fstream>
 #include <math.h>
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // Print progress to console while loading (large models)
 #define OBJL_CONSOLE_OUTPUT
@@ -406,8 +429,180 @@ namespace objl
                 idx--;
             return elements[idx];
         }
+
+        // Skip spaces, tabs and carriage returns
+        inline const char* skipBlanks(const char* p, const char* end)
+        {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+                p++;
+            return p;
+        }
+
+        // Find the end of the token starting at p
+        inline const char* tokenEnd(const char* p, const char* end)
+        {
+            while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+                p++;
+            return p;
+        }
+
+        // Rest of a line after its first token, without surrounding blanks
+        inline std::string_view tailView(const char* p, const char* end)
+        {
+            p = skipBlanks(p, end);
+            while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+                end--;
+            return std::string_view(p, end - p);
+        }
+
+        // Parse a float at p and move p past it, leading blanks are skipped
+        inline bool parseFloat(const char*& p, const char* end, float& out)
+        {
+            p = skipBlanks(p, end);
+            if (p < end && *p == '+')
+                p++;
+            auto result = std::from_chars(p, end, out);
+            if (result.ec == std::errc::result_out_of_range)
+            {
+                // from_chars leaves out untouched on under- and overflow,
+                //	let strtof pick the denormal or infinity like stof did
+                std::string number(p, result.ptr);
+                out = std::strtof(number.c_str(), nullptr);
+            }
+            else if (result.ec != std::errc())
+                return false;
+            p = result.ptr;
+            return true;
+        }
+
+        // Parse an integer at p and move p past it
+        inline bool parseInt(const char*& p, const char* end, int& out)
+        {
+            if (p < end && *p == '+')
+                p++;
+            auto result = std::from_chars(p, end, out);
+            if (result.ec != std::errc())
+                return false;
+            p = result.ptr;
+            return true;
+        }
     }
 
+    // Class: MappedFile
+    //
+    // Description: Read only view of a whole file. The file is memory
+    //	mapped so it can be parsed in place, without reading it into
+    //	strings first.
+    class MappedFile
+    {
+    public:
+        MappedFile()
+        {
+
+        }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile()
+        {
+            Close();
+        }
+
+        // Map the file at Path, return false if it can not be opened
+        bool Open(const std::string& Path)
+        {
+            Close();
+#ifdef _WIN32
+            file = CreateFileA(Path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                               OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+                return false;
+
+            LARGE_INTEGER fileSize;
+            if (!GetFileSizeEx(file, &fileSize))
+            {
+                Close();
+                return false;
+            }
+            size = size_t(fileSize.QuadPart);
+            if (size == 0)
+                return true;
+
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping != nullptr)
+                data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if (data == nullptr)
+            {
+                Close();
+                return false;
+            }
+#else
+            int fd = ::open(Path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+
+            struct stat st;
+            if (::fstat(fd, &st) != 0)
+            {
+                ::close(fd);
+                return false;
+            }
+            size = size_t(st.st_size);
+            if (size > 0)
+            {
+                void* view = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (view == MAP_FAILED)
+                {
+                    ::close(fd);
+                    size = 0;
+                    return false;
+                }
+                ::madvise(view, size, MADV_SEQUENTIAL);
+                data = (const char*)view;
+            }
+            // The mapping stays valid after the descriptor is closed
+            ::close(fd);
+#endif
+            return true;
+        }
+
+        // Unmap the file
+        void Close()
+        {
+#ifdef _WIN32
+            if (data != nullptr)
+                UnmapViewOfFile(data);
+            if (mapping != nullptr)
+                CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE)
+                CloseHandle(file);
+            mapping = nullptr;
+            file = INVALID_HANDLE_VALUE;
+#else
+            if (data != nullptr)
+                ::munmap((void*)data, size);
+#endif
+            data = nullptr;
+            size = 0;
+        }
+
+        const char* Data() const
+        {
+            return data;
+        }
+        size_t Size() const
+        {
+            return size;
+        }
+
+    private:
+        const char* data = nullptr;
+        size_t size = 0;
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#endif
+    };
+
     // Class: Loader
     //
     // Description: The OBJ Model Loader
@@ -426,11 +621,221 @@ namespace objl
 
         // Load a file into the loader
         //
+        // The file is memory mapped and cut into chunks on line
+        //	boundaries, which are parsed on Threads threads (0 picks
+        //	one per core) and merged in file order, so the result does
+        //	not depend on the thread count.
+        //
+        // Every mesh is indexed: equal vertices are stored once and
+        //	Indices holds three entries per triangle.
+        //
+        // If file is loaded return true
+        //
+        // If the file is unable to be found
+        // or unable to be loaded return false
+        bool LoadFile(std::string Path, unsigned int Threads = 0)
+        {
+            // If the file is not an .obj file return false
+            if (Path.size() < 4 || Path.substr(Path.size() - 4, 4) != ".obj")
+                return false;
+
+            MappedFile file;
+
+            if (!file.Open(Path))
+                return false;
+
+            LoadedMeshes.clear();
+            LoadedVertices.clear();
+            LoadedIndices.clear();
+
+            // Cut the file into chunks, no smaller than a megabyte each
+            const char* begin = file.Data();
+            const char* end = begin + file.Size();
+
+            if (Threads == 0)
+                Threads = std::max(1u, std::thread::hardware_concurrency());
+            size_t numChunks = std::min<size_t>(Threads, file.Size() / (1 << 20) + 1);
+
+            std::vector<const char*> cuts(numChunks + 1, end);
+            cuts[0] = begin;
+            for (size_t i = 1; i < numChunks; i++)
+            {
+                const char* cut = std::max(begin + file.Size() / numChunks * i, cuts[i - 1]);
+                const char* newline = (const char*)std::memchr(cut, '\n', end - cut);
+                cuts[i] = newline ? newline + 1 : end;
+            }
+
+            // Parse every chunk on its own
+            std::vector<ObjChunk> chunks(numChunks);
+            ParallelFor(numChunks, [&](size_t i)
+            {
+                ParseChunk(cuts[i], cuts[i + 1], chunks[i]);
+            });
+
+            // Gather the attributes, each chunk learns where its own start
+            size_t numPositions = 0, numTCoords = 0, numNormals = 0;
+            for (auto& chunk : chunks)
+            {
+                chunk.positionBase = int(numPositions);
+                chunk.tcoordBase = int(numTCoords);
+                chunk.normalBase = int(numNormals);
+                numPositions += chunk.positions.size();
+                numTCoords += chunk.tcoords.size();
+                numNormals += chunk.normals.size();
+            }
+
+            std::vector<Vector3> Positions;
+            std::vector<Vector2> TCoords;
+            std::vector<Vector3> Normals;
+            Positions.reserve(numPositions);
+            TCoords.reserve(numTCoords);
+            Normals.reserve(numNormals);
+            for (auto& chunk : chunks)
+            {
+                Positions.insert(Positions.end(), chunk.positions.begin(), chunk.positions.end());
+                TCoords.insert(TCoords.end(), chunk.tcoords.begin(), chunk.tcoords.end());
+                Normals.insert(Normals.end(), chunk.normals.begin(), chunk.normals.end());
+            }
+
+            // Resolve the face indices and triangulate, again per chunk
+            ParallelFor(numChunks, [&](size_t i)
+            {
+                ExpandChunk(chunks[i], Positions, TCoords, Normals);
+            });
+
+            for (auto& chunk : chunks)
+                if (!chunk.valid)
+                    return false;
+
+            // Replay the statements in file order to build the meshes
+            std::vector<Vertex> Vertices;
+            std::vector<unsigned int> Indices;
+
+            std::vector<std::string> MeshMatNames;
+
+            std::string meshname;
+
+            // Where each vertex of the current mesh is stored
+            std::unordered_map<Vertex, unsigned int, VertexHash, VertexEqual> vertexIndex;
+            vertexIndex.reserve(Positions.size());
+
+            auto flushMesh = [&](const std::string& name)
+            {
+                unsigned int loadedBase = (unsigned int)LoadedVertices.size();
+                LoadedVertices.insert(LoadedVertices.end(), Vertices.begin(), Vertices.end());
+                for (unsigned int index : Indices)
+                    LoadedIndices.push_back(loadedBase + index);
+
+                Mesh tempMesh(Vertices, Indices);
+                tempMesh.MeshName = name;
+                LoadedMeshes.push_back(std::move(tempMesh));
+
+                Vertices.clear();
+                Indices.clear();
+                vertexIndex.clear();
+            };
+
+            for (auto& chunk : chunks)
+            {
+                for (auto& statement : chunk.statements)
+                {
+                    switch (statement.kind)
+                    {
+                        case ObjStatement::Face:
+                        {
+                            for (uint32_t i = 0; i < statement.numIndices; i++)
+                            {
+                                const Vertex& vertex = chunk.vertices[statement.firstCorner +
+                                                                      chunk.indices[statement.firstIndex + i]];
+                                auto inserted = vertexIndex.emplace(vertex, (unsigned int)Vertices.size());
+                                if (inserted.second)
+                                    Vertices.push_back(vertex);
+                                Indices.push_back(inserted.first->second);
+                            }
+                            break;
+                        }
+                        case ObjStatement::Group:
+                        {
+                            if (!Indices.empty() && !Vertices.empty())
+                                flushMesh(meshname);
+                            meshname = std::string(statement.text);
+                            break;
+                        }
+                        case ObjStatement::UseMtl:
+                        {
+                            MeshMatNames.emplace_back(statement.text);
+
+                            // Create new Mesh, if Material changes within a group
+                            if (!Indices.empty() && !Vertices.empty())
+                            {
+                                std::string name;
+                                int i = 2;
+                                do
+                                {
+                                    name = meshname + "_" + std::to_string(i++);
+                                } while (std::any_of(LoadedMeshes.begin(), LoadedMeshes.end(),
+                                                     [&](const Mesh& m) { return m.MeshName == name; }));
+                                flushMesh(name);
+                            }
+                            break;
+                        }
+                        case ObjStatement::MtlLib:
+                        {
+                            // Materials are looked up next to the .obj file
+                            std::string pathtomat = Path.substr(0, Path.find_last_of('/') + 1);
+                            pathtomat += std::string(statement.text);
+
+#ifdef OBJL_CONSOLE_OUTPUT
+                            std::cout << "- find materials in: " << pathtomat << std::endl;
+#endif
+
+                            LoadMaterials(pathtomat);
+                            break;
+                        }
+                    }
+                }
+            }
+
+            // Deal with last mesh
+            if (!Indices.empty() && !Vertices.empty())
+                flushMesh(meshname);
+
+#ifdef OBJL_CONSOLE_OUTPUT
+            std::cout
+                    << "- " << Path
+                    << "\t| vertices > " << Positions.size()
+                    << "\t| texcoords > " << TCoords.size()
+                    << "\t| normals > " << Normals.size()
+                    << "\t| triangles > " << (LoadedIndices.size() / 3)
+                    << "\t| threads > " << numChunks << std::endl;
+#endif
+
+            // Set Materials for each Mesh
+            for (size_t i = 0; i < MeshMatNames.size() && i < LoadedMeshes.size(); i++)
+            {
+                for (auto& material : LoadedMaterials)
+                {
+                    if (material.name == MeshMatNames[i])
+                    {
+                        LoadedMeshes[i].MeshMaterial = material;
+                        break;
+                    }
+                }
+            }
+
+            return !LoadedMeshes.empty();
+        }
+
+        // Load a file into the loader with the original line by line
+        //	parser, kept as the reference LoadFile is checked against.
+        //	Meshes are not indexed, every face has its own vertices.
+        //
         // If file is loaded return true
         //
         // If the file is unable to be found
         // or unable to be loaded return false
-        bool LoadFile(std::string Path)
+        bool LoadFileByLine(std::string Path)
+
         {
             // If the file is not an .obj file return false
             if (Path.substr(Path.size() - 4, 4) != ".obj")
@@ -724,6 +1129,258 @@ namespace objl
         std::vector<Material> LoadedMaterials;
 
     private:
+        // A face corner as written in the file. Relative (negative)
+        //	indices are already turned into indices from the start of
+        //	their chunk, Absent marks a missing texture or normal index.
+        struct FaceCorner
+        {
+            static constexpr int Absent = INT32_MIN;
+
+            int position, tcoord, normal;
+            // Bit 0, 1, 2: position, tcoord, normal index is chunk relative
+            uint8_t relative;
+        };
+
+        // Everything but vertex data, in file order
+        struct ObjStatement
+        {
+            enum Kind : uint8_t { Face, Group, UseMtl, MtlLib };
+
+            Kind kind;
+            // Face: its corners, which are also its expanded vertices
+            uint32_t firstCorner = 0, numCorners = 0;
+            // Face: its triangle indices, relative to the first corner
+            uint32_t firstIndex = 0, numIndices = 0;
+            // Group, UseMtl, MtlLib: the rest of the line
+            std::string_view text;
+        };
+
+        // The result of parsing one chunk of a file
+        struct ObjChunk
+        {
+            std::vector<Vector3> positions;
+            std::vector<Vector2> tcoords;
+            std::vector<Vector3> normals;
+            std::vector<FaceCorner> corners;
+            std::vector<ObjStatement> statements;
+
+            // Filled in once all chunks are parsed
+            int positionBase = 0, tcoordBase = 0, normalBase = 0;
+            std::vector<Vertex> vertices;
+            std::vector<unsigned int> indices;
+            bool valid = true;
+        };
+
+        // Vertices are equal if all their bits are, which keeps the
+        //	hash consistent for -0 and NaN
+        struct VertexHash
+        {
+            size_t operator()(const Vertex& vertex) const
+            {
+                uint32_t bits[8];
+                static_assert(sizeof(bits) == sizeof(Vertex), "Vertex is not eight floats");
+                std::memcpy(bits, &vertex, sizeof(bits));
+
+                uint64_t hash = 14695981039346656037ull;
+                for (uint32_t b : bits)
+                    hash = (hash ^ b) * 1099511628211ull;
+                return size_t(hash ^ (hash >> 32));
+            }
+        };
+        struct VertexEqual
+        {
+            bool operator()(const Vertex& a, const Vertex& b) const
+            {
+                return std::memcmp(&a, &b, sizeof(Vertex)) == 0;
+            }
+        };
+
+        // Run func(0) .. func(n - 1), each on its own thread
+        template <class Func>
+        static void ParallelFor(size_t n, const Func& func)
+        {
+            std::vector<std::thread> workers;
+            for (size_t i = 1; i < n; i++)
+                workers.emplace_back(func, i);
+            func(0);
+            for (auto& worker : workers)
+                worker.join();
+        }
+
+        // Parse the lines in [begin, end) without allocating per token
+        static void ParseChunk(const char* begin, const char* end, ObjChunk& chunk)
+        {
+            const char* line = begin;
+            while (line < end)
+            {
+                const char* lineEnd = (const char*)std::memchr(line, '\n', end - line);
+                if (lineEnd == nullptr)
+                    lineEnd = end;
+
+                const char* p = algorithm::skipBlanks(line, lineEnd);
+                const char* keyEnd = algorithm::tokenEnd(p, lineEnd);
+                std::string_view key(p, keyEnd - p);
+                p = keyEnd;
+
+                // Generate a Vertex Position
+                if (key == "v")
+                {
+                    Vector3 vpos;
+                    algorithm::parseFloat(p, lineEnd, vpos.X);
+                    algorithm::parseFloat(p, lineEnd, vpos.Y);
+                    algorithm::parseFloat(p, lineEnd, vpos.Z);
+                    chunk.positions.push_back(vpos);
+                }
+                // Generate a Vertex Texture Coordinate
+                else if (key == "vt")
+                {
+                    Vector2 vtex;
+                    algorithm::parseFloat(p, lineEnd, vtex.X);
+                    algorithm::parseFloat(p, lineEnd, vtex.Y);
+                    chunk.tcoords.push_back(vtex);
+                }
+                // Generate a Vertex Normal
+                else if (key == "vn")
+                {
+                    Vector3 vnor;
+                    algorithm::parseFloat(p, lineEnd, vnor.X);
+                    algorithm::parseFloat(p, lineEnd, vnor.Y);
+                    algorithm::parseFloat(p, lineEnd, vnor.Z);
+                    chunk.normals.push_back(vnor);
+                }
+                // Generate a Face, p, p/t, p//n or p/t/n per corner
+                else if (key == "f")
+                {
+                    ObjStatement face;
+                    face.kind = ObjStatement::Face;
+                    face.firstCorner = uint32_t(chunk.corners.size());
+
+                    auto relativeTo = [](int index, size_t count, int bit, uint8_t& relative)
+                    {
+                        if (index >= 0)
+                            return index - 1;
+                        relative |= uint8_t(1 << bit);
+                        return int(count) + index;
+                    };
+
+                    while ((p = algorithm::skipBlanks(p, lineEnd)) < lineEnd)
+                    {
+                        FaceCorner corner = { FaceCorner::Absent, FaceCorner::Absent, FaceCorner::Absent, 0 };
+                        int index;
+
+                        if (!algorithm::parseInt(p, lineEnd, index) || index == 0)
+                        {
+                            chunk.valid = false;
+                            break;
+                        }
+                        corner.position = relativeTo(index, chunk.positions.size(), 0, corner.relative);
+
+                        if (p < lineEnd && *p == '/')
+                        {
+                            p++;
+                            if (algorithm::parseInt(p, lineEnd, index) && index != 0)
+                                corner.tcoord = relativeTo(index, chunk.tcoords.size(), 1, corner.relative);
+                            if (p < lineEnd && *p == '/')
+                            {
+                                p++;
+                                if (algorithm::parseInt(p, lineEnd, index) && index != 0)
+                                    corner.normal = relativeTo(index, chunk.normals.size(), 2, corner.relative);
+                            }
+                        }
+                        p = algorithm::tokenEnd(p, lineEnd);
+
+                        chunk.corners.push_back(corner);
+                    }
+
+                    face.numCorners = uint32_t(chunk.corners.size()) - face.firstCorner;
+                    chunk.statements.push_back(face);
+                }
+                // Generate a Mesh Object or Prepare for an object to be created
+                else if (key == "o" || key == "g" || key == "usemtl" || key == "mtllib")
+                {
+                    ObjStatement statement;
+                    statement.kind = key == "usemtl" ? ObjStatement::UseMtl :
+                                     key == "mtllib" ? ObjStatement::MtlLib : ObjStatement::Group;
+                    statement.text = algorithm::tailView(p, lineEnd);
+                    chunk.statements.push_back(statement);
+                }
+
+                line = lineEnd + 1;
+            }
+        }
+
+        // Turn the faces of a parsed chunk into vertices and triangles
+        void ExpandChunk(ObjChunk& chunk,
+                         const std::vector<Vector3>& iPositions,
+                         const std::vector<Vector2>& iTCoords,
+                         const std::vector<Vector3>& iNormals)
+        {
+            auto lookup = [&](const auto& elements, int index, int base, bool relative, auto& out)
+            {
+                if (relative)
+                    index += base;
+                if (index < 0 || index >= int(elements.size()))
+                    return false;
+                out = elements[index];
+                return true;
+            };
+
+            chunk.vertices.resize(chunk.corners.size());
+            std::vector<unsigned int> iIndices;
+
+            for (auto& face : chunk.statements)
+            {
+                if (face.kind != ObjStatement::Face)
+                    continue;
+
+                bool noNormal = false;
+                for (uint32_t i = 0; i < face.numCorners; i++)
+                {
+                    const FaceCorner& corner = chunk.corners[face.firstCorner + i];
+                    Vertex& vVert = chunk.vertices[face.firstCorner + i];
+
+                    if (!lookup(iPositions, corner.position, chunk.positionBase, corner.relative & 1, vVert.Position))
+                        chunk.valid = false;
+                    if (corner.tcoord != FaceCorner::Absent &&
+                        !lookup(iTCoords, corner.tcoord, chunk.tcoordBase, corner.relative & 2, vVert.TextureCoordinate))
+                        chunk.valid = false;
+                    if (corner.normal == FaceCorner::Absent)
+                        noNormal = true;
+                    else if (!lookup(iNormals, corner.normal, chunk.normalBase, corner.relative & 4, vVert.Normal))
+                        chunk.valid = false;
+                }
+                if (!chunk.valid)
+                    return;
+
+                auto first = chunk.vertices.begin() + face.firstCorner;
+
+                // take care of missing normals the same way LoadFileByLine does
+                if (noNormal && face.numCorners >= 3)
+                {
+                    Vector3 A = first[0].Position - first[1].Position;
+                    Vector3 B = first[2].Position - first[1].Position;
+
+                    Vector3 normal = math::CrossV3(A, B);
+
+                    for (uint32_t i = 0; i < face.numCorners; i++)
+                        first[i].Normal = normal;
+                }
+
+                face.firstIndex = uint32_t(chunk.indices.size());
+                if (face.numCorners == 3)
+                {
+                    chunk.indices.insert(chunk.indices.end(), { 0, 1, 2 });
+                }
+                else
+                {
+                    iIndices.clear();
+                    VertexTriangluation(iIndices, std::vector<Vertex>(first, first + face.numCorners));
+                    chunk.indices.insert(chunk.indices.end(), iIndices.begin(), iIndices.end());
+                }
+                face.numIndices = uint32_t(chunk.indices.size()) - face.firstIndex;
+            }
+        }
+
         // Generate vertices from a list of positions,
         //	tcoords, normals and a face line
         void GenVerticesFromRawOBJ(std::vector<Vertex>& oVerts,
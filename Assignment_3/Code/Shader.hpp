@@ -8,6 +8,49 @@
 #include "Texture.hpp"
 
 
+struct light
+{
+    Eigen::Vector3f position;
+    Eigen::Vector3f intensity;
+};
+
+// Up to capacity lights, stored in place
+struct light_list
+{
+    static constexpr int capacity = 8;
+
+    light items[capacity];
+    int count = 0;
+
+    // False once all capacity slots are in use
+    bool push_back(const light& l)
+    {
+        if (count == capacity)
+            return false;
+        items[count++] = l;
+        return true;
+    }
+
+    const light* begin() const { return items; }
+    const light* end() const { return items + count; }
+    int size() const { return count; }
+};
+
+// Constants of a draw, shared by all its fragments. The rasterizer keeps the
+// block set by set_uniforms and hands the shaders a pointer to it, so nothing
+// is built or allocated per fragment.
+struct shader_uniforms
+{
+    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
+    Eigen::Vector3f amb_light_intensity = Eigen::Vector3f(10, 10, 10);
+    Eigen::Vector3f eye_pos = Eigen::Vector3f(0, 0, 10);
+    float p = 150;
+    // bump and displacement mapping scales
+    float kh = 0.2, kn = 0.1;
+    light_list lights;
+};
+
 struct fragment_shader_payload
 {
     fragment_shader_payload()
@@ -23,7 +66,11 @@ struct fragment_shader_payload
     Eigen::Vector3f color;
     Eigen::Vector3f normal;
     Eigen::Vector2f tex_coords;
+    // change of tex_coords to the next pixel in x and y, for mip mapping
+    Eigen::Vector2f tex_dx = Eigen::Vector2f::Zero();
+    Eigen::Vector2f tex_dy = Eigen::Vector2f::Zero();
     Texture* texture;
+    const shader_uniforms* uniforms = nullptr;
 };
 
 struct vertex_shader_payload
@@ -31,4 +78,32 @@ struct vertex_shader_payload
     Eigen::Vector3f position;
 };
 
+// Fragments shaded together, one lane each. The inputs are stored as
+// structure of arrays, so a shader that loops over the lanes with plain
+// float math compiles to SIMD code of the packet's width.
+struct fragment_packet
+{
+#if defined(__AVX2__)
+    static constexpr int width = 8;
+#else
+    static constexpr int width = 4;
+#endif
+
+    int count = 0;  // lanes in use, the others hold stale fragments
+    float view_pos[3][width] = {};
+    float normal[3][width] = {};  // normalized
+    float tex_coords[2][width] = {};
+    float tex_dx[2][width] = {};
+    float tex_dy[2][width] = {};
+    float color[3][width] = {};
+    Texture* texture = nullptr;
+    const shader_uniforms* uniforms = nullptr;
+};
+
+// Shader output for a fragment_packet, 0 to 255 per channel
+struct color_packet
+{
+    float color[3][fragment_packet::width];
+};
+
 #endif //RASTERIZER_SHADER_H
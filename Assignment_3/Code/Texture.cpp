@@ -2,3 +2,201 @@
 // Created by LEI XU on 4/27/19.
 //
 
+#include "Texture.hpp"
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+namespace
+{
+    constexpr char gradient_magic[8] = { 'T', 'E', 'X', 'G', 'R', 'A', 'D', 0 };
+    constexpr uint32_t gradient_version = 1;
+
+    // Start of a .grad file, the blocks of the map follow
+    struct gradient_header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t width, height;
+        uint32_t blocks;
+        // Size and FNV-1a hash of the image file the map was derived from
+        uint64_t image_size;
+        uint64_t image_hash;
+    };
+    static_assert(sizeof(gradient_header) == 40, "headers are compared byte for byte");
+
+    // Fills in the image fields of header, false if the file cannot be read
+    bool hash_image(const std::string& path, gradient_header& header)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            return false;
+        std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (bytes.empty())
+            return false;
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : bytes)
+            hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+        header.image_size = bytes.size();
+        header.image_hash = hash;
+        return true;
+    }
+}
+
+Texture::Texture(const std::string& name, TexelFormat texel_format) : path(name), format(texel_format)
+{
+    cv::Mat image_data = cv::imread(name);
+    cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
+    width = image_data.cols;
+    height = image_data.rows;
+
+    std::vector<Eigen::Vector3f> texels(size_t(width) * height);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            auto color = image_data.at<cv::Vec3b>(y, x);
+            texels[size_t(y) * width + x] = Eigen::Vector3f(color[0], color[1], color[2]);
+        }
+    }
+    build_mip_chain(std::move(texels));
+}
+
+void Texture::build_mip_chain(std::vector<Eigen::Vector3f> texels)
+{
+    int w = width, h = height;
+    for (;;)
+    {
+        mip_level level;
+        level.width = w;
+        level.height = h;
+
+        // Z order of the blocks within a tile, then tiles row by row
+        const int tile = block * tile_blocks;
+        int tiles_x = (w + tile - 1) / tile, tiles_y = (h + tile - 1) / tile;
+        auto spread = [](int b) { return (b & 1) | (b & 2) << 1 | (b & 4) << 2; };
+        for (int x = 0; x < w; x++)
+        {
+            int b = x / block;
+            int block_index = (b / tile_blocks) * tile_blocks * tile_blocks + spread(b % tile_blocks);
+            level.x_offset.push_back(block_index * block * block + x % block);
+        }
+        for (int y = 0; y < h; y++)
+        {
+            int b = y / block;
+            int block_index = (b / tile_blocks) * tiles_x * tile_blocks * tile_blocks + (spread(b % tile_blocks) << 1);
+            level.y_offset.push_back(block_index * block * block + (y % block) * block);
+        }
+
+        size_t blocks = size_t(tiles_x) * tiles_y * tile_blocks * tile_blocks;
+        if (format == TexelFormat::RGBA32F)
+            level.floats.resize(blocks);
+        else
+            level.bytes.resize(blocks);
+
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                const Eigen::Vector3f& c = texels[size_t(y) * w + x];
+                unsigned int i = level.x_offset[x] + level.y_offset[y];
+                unsigned int b = i / (block * block), t = i % (block * block);
+                if (format == TexelFormat::RGBA32F)
+                {
+                    float* f = level.floats[b].texel[t];
+                    f[0] = c.x();
+                    f[1] = c.y();
+                    f[2] = c.z();
+                    f[3] = 0;
+                }
+                else
+                {
+                    auto channel = [](float value) {
+                        return (uint32_t)std::clamp((int)std::lround(value), 0, 255);
+                    };
+                    level.bytes[b].texel[t] = channel(c.x()) | channel(c.y()) << 8 | channel(c.z()) << 16;
+                }
+            }
+        }
+        levels.push_back(std::move(level));
+
+        if (w == 1 && h == 1)
+            break;
+
+        // Box filter down from the unrounded texels, so 8 bit levels do not
+        // accumulate rounding. An odd last row or column is repeated.
+        int next_w = std::max(1, w / 2), next_h = std::max(1, h / 2);
+        std::vector<Eigen::Vector3f> next(size_t(next_w) * next_h);
+        for (int y = 0; y < next_h; y++)
+        {
+            for (int x = 0; x < next_w; x++)
+            {
+                int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+                next[size_t(y) * next_w + x] = 0.25f * (texels[size_t(y0) * w + x0] + texels[size_t(y0) * w + x1] +
+                                                        texels[size_t(y1) * w + x0] + texels[size_t(y1) * w + x1]);
+            }
+        }
+        texels = std::move(next);
+        w = next_w;
+        h = next_h;
+    }
+}
+
+void Texture::load_gradient_map()
+{
+    const mip_level& level = levels[0];
+    int w = level.width, h = level.height;
+    gradients.assign(format == TexelFormat::RGBA32F ? level.floats.size() : level.bytes.size(), gradient_block{});
+
+    gradient_header header = {};
+    std::memcpy(header.magic, gradient_magic, sizeof(header.magic));
+    header.version = gradient_version;
+    header.width = w;
+    header.height = h;
+    header.blocks = (uint32_t)gradients.size();
+    bool hashed = hash_image(path, header);
+
+    std::string cache = path + ".grad";
+    gradient_header cached;
+    std::ifstream in(cache, std::ios::binary);
+    if (hashed && in.read((char*)&cached, sizeof(cached)) && std::memcmp(&cached, &header, sizeof(header)) == 0 &&
+        in.read((char*)gradients.data(), std::streamsize(gradients.size() * sizeof(gradient_block))))
+        return;
+
+    std::vector<float> heights(size_t(w) * h);
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            unsigned int i = level.x_offset[x] + level.y_offset[y];
+            Eigen::Vector3f color = format == TexelFormat::RGBA32F ? fetch<TexelFormat::RGBA32F>(level, i)
+                                                                   : fetch<TexelFormat::RGBA8>(level, i);
+            heights[size_t(y) * w + x] = color.norm();
+        }
+    }
+    // v grows upwards, so the next texel up is the row above, and the
+    // differences are 0 past the edges as lookups clamp there
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            float height = heights[size_t(y) * w + x];
+            float du = heights[size_t(y) * w + std::min(x + 1, w - 1)] - height;
+            float dv = heights[size_t(std::max(y - 1, 0)) * w + x] - height;
+            unsigned int i = level.x_offset[x] + level.y_offset[y];
+            int16_t* g = gradients[i / (block * block)].texel[i % (block * block)];
+            g[0] = (int16_t)std::lround(height * gradient_scale);
+            g[1] = (int16_t)std::lround(du * gradient_scale);
+            g[2] = (int16_t)std::lround(dv * gradient_scale);
+            g[3] = 0;
+        }
+    }
+
+    // Without a readable image there is nothing to tie a cached map to
+    if (!hashed)
+        return;
+    std::ofstream out(cache, std::ios::binary);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)gradients.data(), std::streamsize(gradients.size() * sizeof(gradient_block)));
+}
@@ -7,27 +7,188 @@
 #include "global.hpp"
 #include <Eigen/Eigen>
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// How a texture stores its texels. Either way getColor and the samplers
+// return 0 to 255 per channel.
+enum class TexelFormat
+{
+    // 8 bits per channel, 16 texels to a 64 byte cache line
+    RGBA8,
+    // 32 bit floats, for data such as height maps that 8 bit steps would
+    // band once filtered
+    RGBA32F
+};
+
+// An image with its mip chain. Each level is stored in 4x4 texel blocks,
+// which follow a Z curve within 32x32 texel tiles, so the texels a lookup
+// needs usually share a cache line and nearby lookups share pages.
+// Lookups clamp to the edge.
 class Texture{
 private:
-    cv::Mat image_data;
+    static constexpr int block = 4;         // texels
+    static constexpr int tile_blocks = 8;   // blocks
 
-public:
-    Texture(const std::string& name)
+    struct alignas(64) byte_block
+    {
+        uint32_t texel[block * block];  // r | g << 8 | b << 16
+    };
+    struct alignas(64) float_block
+    {
+        float texel[block * block][4];
+    };
+    // Height, dU, dV and 0 in steps of 1 / gradient_scale, so the map takes
+    // half as much cache as float texels would. Heights of 8 bit colors stay
+    // below 442, which fits.
+    static constexpr float gradient_scale = 64;
+    struct alignas(64) gradient_block
+    {
+        int16_t texel[block * block][4];
+    };
+
+    // The index of texel (x, y) in the blocks of a level is
+    // x_offset[x] + y_offset[y]
+    struct mip_level
+    {
+        int width, height;
+        std::vector<unsigned int> x_offset, y_offset;
+        std::vector<byte_block> bytes;      // RGBA8
+        std::vector<float_block> floats;    // RGBA32F
+    };
+
+    std::string path;
+    TexelFormat format;
+    std::vector<mip_level> levels;
+    // Height, dU and dV of each texel of level 0, in level 0's layout
+    std::vector<gradient_block> gradients;
+
+    // Texel i of a level's blocks
+    template <TexelFormat F>
+    static Eigen::Vector3f fetch(const mip_level& level, unsigned int i)
+    {
+        if constexpr (F == TexelFormat::RGBA32F)
+        {
+            const float_block* blocks = level.floats.data();
+            const float* f = blocks[i / (block * block)].texel[i % (block * block)];
+            return Eigen::Vector3f(f[0], f[1], f[2]);
+        }
+        else
+        {
+            const byte_block* blocks = level.bytes.data();
+            uint32_t c = blocks[i / (block * block)].texel[i % (block * block)];
+            return Eigen::Vector3f(float(c & 0xFF), float((c >> 8) & 0xFF), float((c >> 16) & 0xFF));
+        }
+    }
+
+    template <TexelFormat F>
+    static Eigen::Vector3f bilinear(const mip_level& level, float u, float v)
+    {
+        float x = u * level.width - 0.5f;
+        float y = (1 - v) * level.height - 0.5f;
+        float x0 = std::floor(x), y0 = std::floor(y);
+        float s = x - x0, t = y - y0;
+
+        const unsigned int* x_offset = level.x_offset.data();
+        const unsigned int* y_offset = level.y_offset.data();
+        unsigned int left = x_offset[std::clamp((int)x0, 0, level.width - 1)];
+        unsigned int right = x_offset[std::clamp((int)x0 + 1, 0, level.width - 1)];
+        unsigned int top = y_offset[std::clamp((int)y0, 0, level.height - 1)];
+        unsigned int bottom = y_offset[std::clamp((int)y0 + 1, 0, level.height - 1)];
+
+        Eigen::Vector3f upper = (1 - s) * fetch<F>(level, left + top) + s * fetch<F>(level, right + top);
+        Eigen::Vector3f lower = (1 - s) * fetch<F>(level, left + bottom) + s * fetch<F>(level, right + bottom);
+        return (1 - t) * upper + t * lower;
+    }
+
+    template <TexelFormat F>
+    Eigen::Vector3f trilinear(float u, float v, float level) const
+    {
+        int fine = std::clamp((int)level, 0, mip_levels() - 1);
+        float blend = level - fine;
+        Eigen::Vector3f color = bilinear<F>(levels[fine], u, v);
+        if (blend > 0 && fine + 1 < mip_levels())
+            color = (1 - blend) * color + blend * bilinear<F>(levels[fine + 1], u, v);
+        return color;
+    }
+
+    // The texel column or row of coordinate s in [0, 1] at a level of n
+    // texels, clamped to the edge
+    static int texel(float s, int n)
     {
-        image_data = cv::imread(name);
-        cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
-        width = image_data.cols;
-        height = image_data.rows;
+        return (int)std::min(std::max(s * n, 0.0f), float(n - 1));
     }
 
+    // Fills levels from the RGB texels of level 0, row by row from the top
+    void build_mip_chain(std::vector<Eigen::Vector3f> texels);
+
+public:
+    Texture(const std::string& name, TexelFormat texel_format = TexelFormat::RGBA8);
+
     int width, height;
 
-    Eigen::Vector3f getColor(float u, float v)
+    int mip_levels() const { return (int)levels.size(); }
+
+    // Nearest texel of the full resolution image
+    Eigen::Vector3f getColor(float u, float v) const
+    {
+        const mip_level& level = levels[0];
+        unsigned int i = level.x_offset[texel(u, level.width)] + level.y_offset[texel(1 - v, level.height)];
+        if (format == TexelFormat::RGBA32F)
+            return fetch<TexelFormat::RGBA32F>(level, i);
+        return fetch<TexelFormat::RGBA8>(level, i);
+    }
+
+    // Bilinear filtering within one mip level
+    Eigen::Vector3f getColorBilinear(float u, float v, int level = 0) const
+    {
+        const mip_level& l = levels[std::clamp(level, 0, mip_levels() - 1)];
+        if (format == TexelFormat::RGBA32F)
+            return bilinear<TexelFormat::RGBA32F>(l, u, v);
+        return bilinear<TexelFormat::RGBA8>(l, u, v);
+    }
+
+    // The mip level of a pixel whose texture coordinates change by tex_dx
+    // and tex_dy from one pixel to the next along x and y
+    float getLevel(const Eigen::Vector2f& tex_dx, const Eigen::Vector2f& tex_dy) const
+    {
+        float dx = Eigen::Vector2f(tex_dx.x() * width, tex_dx.y() * height).squaredNorm();
+        float dy = Eigen::Vector2f(tex_dy.x() * width, tex_dy.y() * height).squaredNorm();
+        // log2 of the longer footprint axis, in texels
+        float level = 0.5f * std::log2(std::max({dx, dy, 1.0f}));
+        return std::min(level, float(mip_levels() - 1));
+    }
+
+    // Bilinear filtering in the two mip levels around level, blended
+    Eigen::Vector3f getColorTrilinear(float u, float v, float level) const
+    {
+        if (format == TexelFormat::RGBA32F)
+            return trilinear<TexelFormat::RGBA32F>(u, v, level);
+        return trilinear<TexelFormat::RGBA8>(u, v, level);
+    }
+
+    Eigen::Vector3f getColorTrilinear(float u, float v, const Eigen::Vector2f& tex_dx, const Eigen::Vector2f& tex_dy) const
+    {
+        return getColorTrilinear(u, v, getLevel(tex_dx, tex_dy));
+    }
+
+    // Derives the gradient map for bump and displacement mapping. A texel's
+    // height is the length of its color, dU and dV are the differences to
+    // the heights of the next texels right and up. The map is read from the
+    // image path with ".grad" appended if it was written there from the same
+    // image file, and is written there otherwise.
+    void load_gradient_map();
+
+    // (height, dU, dV) at the nearest texel, once the gradient map is loaded
+    Eigen::Vector3f getGradient(float u, float v) const
     {
-        auto u_img = u * width;
-        auto v_img = (1 - v) * height;
-        auto color = image_data.at<cv::Vec3b>(v_img, u_img);
-        return Eigen::Vector3f(color[0], color[1], color[2]);
+        const mip_level& level = levels[0];
+        unsigned int i = level.x_offset[texel(u, level.width)] + level.y_offset[texel(1 - v, level.height)];
+        const int16_t* g = gradients[i / (block * block)].texel[i % (block * block)];
+        return Eigen::Vector3f(g[0], g[1], g[2]) * (1 / gradient_scale);
     }
 
 };
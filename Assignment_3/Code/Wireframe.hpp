@@ -0,0 +1,247 @@
+//
+// Wireframes of indexed triangle meshes.
+//
+// An edge shared by several triangles is drawn once. Edges are clipped to
+// the near plane in clip space and to the viewport in screen space, so no
+// pixel off the screen is ever addressed, and are then stepped with a
+// midpoint DDA that moves a pointer through the color buffer rather than
+// recomputing the pixel index. The pixel at each step follows from the
+// step alone, so a band of rows can be drawn without walking the rest of
+// the line, and bands drawn by separate workers give the same image as one.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <vector>
+#include <Eigen/Eigen>
+
+namespace rst
+{
+    // A mesh edge by vertex index, a < b
+    struct mesh_edge
+    {
+        int a, b;
+    };
+
+    // The edges of count triangles, each once however many triangles share it
+    inline std::vector<mesh_edge> unique_edges(const Eigen::Vector3i* triangles, size_t count)
+    {
+        std::vector<uint64_t> keys;
+        keys.reserve(count * 3);
+        for (size_t k = 0; k < count; ++k)
+        {
+            const Eigen::Vector3i& t = triangles[k];
+            for (int i = 0; i < 3; ++i)
+            {
+                uint32_t a = t[i], b = t[(i + 1) % 3];
+                if (a != b)
+                    keys.push_back(uint64_t(std::min(a, b)) << 32 | std::max(a, b));
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        std::vector<mesh_edge> edges(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i)
+            edges[i] = { int(keys[i] >> 32), int(keys[i] & 0xFFFFFFFFu) };
+        return edges;
+    }
+
+    // A line from pixel (x0, y0) to pixel (x1, y1), both on the screen
+    struct line_segment
+    {
+        int x0, y0, x1, y1;
+    };
+
+    // Where a projection puts the points in front of the camera: facing
+    // times their w is at least w_near
+    struct near_plane
+    {
+        float facing = 1.0f;
+        float w_near = 0.0f;
+
+        explicit near_plane(const Eigen::Matrix4f& p)
+        {
+            // A perspective projection makes w proportional to the view
+            // space z, and the camera looks down -z. Only what lies behind
+            // the camera has to go before the divide.
+            if (p(3, 0) == 0 && p(3, 1) == 0 && p(3, 3) == 0 && p(3, 2) != 0)
+            {
+                facing = p(3, 2) < 0 ? 1.0f : -1.0f;
+                w_near = 1e-5f * std::abs(p(3, 2));
+            }
+            else
+            {
+                w_near = -std::numeric_limits<float>::infinity();
+            }
+        }
+    };
+
+    // Liang-Barsky: cuts the line p0 p1 to [x_min, x_max] x [y_min, y_max],
+    // false if none of it is inside
+    inline bool clip_to_rect(Eigen::Vector2d& p0, Eigen::Vector2d& p1, double x_min, double y_min, double x_max,
+                             double y_max)
+    {
+        Eigen::Vector2d d = p1 - p0;
+        // per side, the change towards its outside and the room left inside
+        const double towards[4] = { -d.x(), d.x(), -d.y(), d.y() };
+        const double room[4] = { p0.x() - x_min, x_max - p0.x(), p0.y() - y_min, y_max - p0.y() };
+        double t0 = 0, t1 = 1;
+        for (int side = 0; side < 4; ++side)
+        {
+            if (towards[side] == 0)
+            {
+                if (room[side] < 0)
+                    return false;
+                continue;
+            }
+            double t = room[side] / towards[side];
+            if (towards[side] < 0)
+                t0 = std::max(t0, t);
+            else
+                t1 = std::min(t1, t);
+            if (!(t0 <= t1))
+                return false;
+        }
+        Eigen::Vector2d start = p0 + t0 * d;
+        p1 = p0 + t1 * d;
+        p0 = start;
+        return true;
+    }
+
+    // A vertex in clip space, and on the screen if it is in front of the
+    // near plane
+    struct wire_vertex
+    {
+        Eigen::Vector4f clip;
+        Eigen::Vector2f screen;
+        bool in_front;
+    };
+
+    // Viewport transform, with pixel (x, y) covering [x, x + 1) x [y, y + 1)
+    inline Eigen::Vector2f to_screen(const Eigen::Vector4f& clip, int width, int height)
+    {
+        return Eigen::Vector2f(0.5f * width * (clip.x() / clip.w() + 1.0f), 0.5f * height * (clip.y() / clip.w() + 1.0f));
+    }
+
+    inline wire_vertex project_vertex(const Eigen::Vector4f& clip, const near_plane& near, int width, int height)
+    {
+        wire_vertex v;
+        v.clip = clip;
+        v.in_front = near.facing * clip.w() >= near.w_near;
+        v.screen = v.in_front ? to_screen(clip, width, height) : Eigen::Vector2f(0, 0);
+        return v;
+    }
+
+    // The pixels of the edge between a and b on a width x height screen,
+    // false if no part of it is visible
+    inline bool project_edge(const wire_vertex& a, const wire_vertex& b, const near_plane& near, int width, int height,
+                             line_segment& out)
+    {
+        Eigen::Vector2f s0 = a.screen, s1 = b.screen;
+        if (!a.in_front || !b.in_front)
+        {
+            if (!a.in_front && !b.in_front)
+                return false;
+            // the end behind the near plane moves onto it
+            const wire_vertex& front = a.in_front ? a : b;
+            const wire_vertex& back = a.in_front ? b : a;
+            float d_front = near.facing * front.clip.w() - near.w_near;
+            float d_back = near.facing * back.clip.w() - near.w_near;
+            Eigen::Vector4f cut = front.clip + (d_front / (d_front - d_back)) * (back.clip - front.clip);
+            (a.in_front ? s1 : s0) = to_screen(cut, width, height);
+        }
+
+        auto pixel = [](double v, int size) { return std::clamp((int)std::floor(v), 0, size - 1); };
+        bool on_screen = s0.x() >= 0 && s0.x() < width && s0.y() >= 0 && s0.y() < height &&
+                         s1.x() >= 0 && s1.x() < width && s1.y() >= 0 && s1.y() < height;
+        if (on_screen)
+        {
+            out = { (int)s0.x(), (int)s0.y(), (int)s1.x(), (int)s1.y() };
+            return true;
+        }
+
+        Eigen::Vector2d p0 = s0.cast<double>(), p1 = s1.cast<double>();
+        if (!p0.allFinite() || !p1.allFinite() || !clip_to_rect(p0, p1, 0, 0, width, height))
+            return false;
+        out = { pixel(p0.x(), width), pixel(p0.y(), height), pixel(p1.x(), width), pixel(p1.y(), height) };
+        return true;
+    }
+
+    // Calls plot on the pixels of line s that lie in rows [y_begin, y_end).
+    // Pixel (x, y) is origin[x * pixel_step + y * row_step]. Step i along
+    // the longer axis is drawn at i * (minor length / major length) along
+    // the shorter one, rounded half up.
+    template <typename Pixel, typename Plot>
+    void draw_segment(Pixel* origin, std::ptrdiff_t pixel_step, std::ptrdiff_t row_step, const line_segment& s,
+                      int y_begin, int y_end, Plot&& plot)
+    {
+        int dx = s.x1 - s.x0, dy = s.y1 - s.y0;
+        int sx = dx < 0 ? -1 : 1, sy = dy < 0 ? -1 : 1;
+        int64_t adx = std::abs(dx), ady = std::abs(dy);
+        bool x_major = adx >= ady;
+        int64_t n = x_major ? adx : ady;
+        int64_t d = x_major ? ady : adx;
+
+        // The rows of the band as distances m from y0, [m_begin, m_end)
+        int64_t m_begin = sy > 0 ? y_begin - s.y0 : s.y0 - y_end + 1;
+        int64_t m_end = sy > 0 ? y_end - s.y0 : s.y0 - y_begin + 1;
+        m_begin = std::max<int64_t>(m_begin, 0);
+        m_end = std::min<int64_t>(m_end, ady + 1);
+        if (m_begin >= m_end)
+            return;
+        if (n == 0)
+        {
+            plot(origin[s.x0 * pixel_step + s.y0 * row_step]);
+            return;
+        }
+
+        // Along x, step i is on row floor((2 i d + n) / 2n), so the first
+        // step on row m or beyond is ceil((2m - 1) n / 2d)
+        auto first_step = [&](int64_t m) -> int64_t {
+            if (m == 0)
+                return 0;
+            if (d == 0 || m > d)
+                return n + 1;
+            return std::min(n + 1, ((2 * m - 1) * n + 2 * d - 1) / (2 * d));
+        };
+        int64_t i = x_major ? first_step(m_begin) : m_begin;
+        int64_t i_end = x_major ? first_step(m_end) : m_end;
+        if (i >= i_end)
+            return;
+
+        // The minor coordinate of step i is acc / 2n, stepped as a remainder
+        int64_t minor = 0, rem = n;
+        if (i > 0)
+        {
+            int64_t acc = 2 * i * d + n;
+            minor = acc / (2 * n);
+            rem = acc % (2 * n);
+        }
+        int64_t x = x_major ? s.x0 + sx * i : s.x0 + sx * minor;
+        int64_t y = x_major ? s.y0 + sy * minor : s.y0 + sy * i;
+        std::ptrdiff_t major_step = x_major ? sx * pixel_step : sy * row_step;
+        std::ptrdiff_t minor_step = x_major ? sy * row_step : sx * pixel_step;
+
+        Pixel* p = origin + (x * pixel_step + y * row_step);
+        for (;;)
+        {
+            plot(*p);
+            if (++i == i_end)
+                break;
+            p += major_step;
+            rem += 2 * d;
+            if (rem >= 2 * n)
+            {
+                rem -= 2 * n;
+                p += minor_step;
+            }
+        }
+    }
+}
@@ -1,4 +1,11 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <thread>
 #include <opencv2/opencv.hpp>
 
 #include "global.hpp"
@@ -6,7 +13,8 @@
 #include "Triangle.hpp"
 #include "Shader.hpp"
 #include "Texture.hpp"
-#include "OBJ_Loader.h"
+#include "BinaryMesh.hpp"
+#include "FrameWriter.hpp"
 
 Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
 {
@@ -108,35 +116,28 @@ static Eigen::Vector3f reflect(const Eigen::Vector3f& vec, const Eigen::Vector3f
     return (2 * costheta * axis - vec).normalized();
 }
 
-struct light
-{
-    Eigen::Vector3f position;
-    Eigen::Vector3f intensity;
-};
-
 Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 {
     Eigen::Vector3f return_color = {0, 0, 0};
     if (payload.texture)
     {
         // TODO: Get the texture value at the texture coordinates of the current fragment
-        return_color = payload.texture->getColor(payload.tex_coords[0], payload.tex_coords[1]);
+        // filtered from the mip levels the pixel's footprint spans
+        return_color = payload.texture->getColorTrilinear(payload.tex_coords[0], payload.tex_coords[1],
+                                                          payload.tex_dx, payload.tex_dy);
     }
     Eigen::Vector3f texture_color;
     texture_color << return_color.x(), return_color.y(), return_color.z();
 
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    const shader_uniforms& uniforms = *payload.uniforms;
+    const Eigen::Vector3f& ka = uniforms.ka;
     Eigen::Vector3f kd = texture_color / 255.f;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
+    const Eigen::Vector3f& ks = uniforms.ks;
 
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
+    const Eigen::Vector3f& amb_light_intensity = uniforms.amb_light_intensity;
+    const Eigen::Vector3f& eye_pos = uniforms.eye_pos;
 
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
-
-    float p = 150;
+    float p = uniforms.p;
 
     Eigen::Vector3f color = texture_color;
     Eigen::Vector3f point = payload.view_pos;
@@ -144,7 +145,7 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 
     Eigen::Vector3f result_color = {0, 0, 0};
 
-    for (auto& light : lights)
+    for (auto& light : uniforms.lights)
     {
         // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
         // components are. Then, accumulate that result on the *result_color* object.
@@ -162,18 +163,15 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 
 Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
 {
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    const shader_uniforms& uniforms = *payload.uniforms;
+    const Eigen::Vector3f& ka = uniforms.ka;
     Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
+    const Eigen::Vector3f& ks = uniforms.ks;
 
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
+    const Eigen::Vector3f& amb_light_intensity = uniforms.amb_light_intensity;
+    const Eigen::Vector3f& eye_pos = uniforms.eye_pos;
 
-    float p = 150;
+    float p = uniforms.p;
 
     Eigen::Vector3f color = payload.color;
     Eigen::Vector3f point = payload.view_pos;
@@ -181,7 +179,7 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
 
     Eigen::Vector3f result_color = {0.0f, 0.0f, 0.0f};
     
-    for (auto& light : lights)
+    for (auto& light : uniforms.lights)
     {
         // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
         // components are. Then, accumulate that result on the *result_color* object.
@@ -199,28 +197,136 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
 }
 
 
+// Packet versions of the shaders above, for the templated rasterizer::draw.
+// The shader type is known at compile time, so the lane loops are inlined
+// into the rasterizer's packet kernel and vectorize.
+static constexpr int W = fragment_packet::width;
+
+struct normal_packet_shader
+{
+    void operator()(const fragment_packet& in, color_packet& out) const
+    {
+        for (int c = 0; c < 3; ++c)
+            for (int k = 0; k < W; ++k)
+                out.color[c][k] = (in.normal[c][k] + 1.0f) / 2.f * 255;
+    }
+};
+
+// x^150 by squaring, which unlike std::pow vectorizes
+static inline float pow150(float x)
+{
+    float x2 = x * x, x4 = x2 * x2, x8 = x4 * x4, x16 = x8 * x8;
+    float x32 = x16 * x16, x64 = x32 * x32, x128 = x64 * x64;
+    return x128 * x16 * x4 * x2;
+}
+
+// Blinn-Phong with the uniforms' lights and a diffuse color per lane, with
+// power(x) raising x to the uniforms' exponent
+template <typename Power>
+static void blinn_phong_lanes(const fragment_packet& in, const float (&kd)[3][W], color_packet& out, Power power)
+{
+    const shader_uniforms& uniforms = *in.uniforms;
+    const Eigen::Vector3f& eye_pos = uniforms.eye_pos;
+    const float ks[3] = {uniforms.ks[0], uniforms.ks[1], uniforms.ks[2]};
+    float ambient[3];
+    for (int c = 0; c < 3; ++c)
+        ambient[c] = uniforms.ka[c] * uniforms.amb_light_intensity[c];
+
+    for (int c = 0; c < 3; ++c)
+        for (int k = 0; k < W; ++k)
+            out.color[c][k] = 0;
+
+    for (auto& light : uniforms.lights)
+    {
+        const float intensity[3] = {light.intensity[0], light.intensity[1], light.intensity[2]};
+        for (int k = 0; k < W; ++k)
+        {
+            float l[3], v[3], h[3];
+            for (int c = 0; c < 3; ++c)
+            {
+                l[c] = light.position[c] - in.view_pos[c][k];
+                v[c] = eye_pos[c] - in.view_pos[c][k];
+            }
+            float r2 = l[0] * l[0] + l[1] * l[1] + l[2] * l[2];
+            float inv_l = 1 / std::sqrt(r2);
+            float inv_v = 1 / std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+            for (int c = 0; c < 3; ++c)
+            {
+                l[c] *= inv_l;
+                h[c] = l[c] + v[c] * inv_v;
+            }
+            float inv_h = 1 / std::sqrt(h[0] * h[0] + h[1] * h[1] + h[2] * h[2]);
+
+            float nl = 0, nh = 0;
+            for (int c = 0; c < 3; ++c)
+            {
+                nl += l[c] * in.normal[c][k];
+                nh += h[c] * in.normal[c][k];
+            }
+            float specular = power(std::max(0.0f, nh * inv_h));
+            float diffuse = std::max(0.0f, nl);
+            for (int c = 0; c < 3; ++c)
+                out.color[c][k] += ambient[c] + (ks[c] * specular + kd[c][k] * diffuse) * intensity[c] / r2;
+        }
+    }
+
+    for (int c = 0; c < 3; ++c)
+        for (int k = 0; k < W; ++k)
+            out.color[c][k] *= 255.f;
+}
+
+static void blinn_phong_packet(const fragment_packet& in, const float (&kd)[3][W], color_packet& out)
+{
+    float p = in.uniforms->p;
+    if (p == 150)
+        blinn_phong_lanes(in, kd, out, pow150);
+    else
+        blinn_phong_lanes(in, kd, out, [p](float x) { return std::pow(x, p); });
+}
+
+struct phong_packet_shader
+{
+    void operator()(const fragment_packet& in, color_packet& out) const
+    {
+        blinn_phong_packet(in, in.color, out);
+    }
+};
+
+struct texture_packet_shader
+{
+    void operator()(const fragment_packet& in, color_packet& out) const
+    {
+        float kd[3][W] = {};
+        for (int k = 0; k < in.count && in.texture; ++k)
+        {
+            Eigen::Vector2f tex_dx(in.tex_dx[0][k], in.tex_dx[1][k]), tex_dy(in.tex_dy[0][k], in.tex_dy[1][k]);
+            Eigen::Vector3f texture_color =
+                    in.texture->getColorTrilinear(in.tex_coords[0][k], in.tex_coords[1][k], tex_dx, tex_dy) / 255.f;
+            for (int c = 0; c < 3; ++c)
+                kd[c][k] = texture_color[c];
+        }
+        blinn_phong_packet(in, kd, out);
+    }
+};
 
 Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payload)
 {
     
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    const shader_uniforms& uniforms = *payload.uniforms;
+    const Eigen::Vector3f& ka = uniforms.ka;
     Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
+    const Eigen::Vector3f& ks = uniforms.ks;
 
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
+    const Eigen::Vector3f& amb_light_intensity = uniforms.amb_light_intensity;
+    const Eigen::Vector3f& eye_pos = uniforms.eye_pos;
 
-    float p = 150;
+    float p = uniforms.p;
 
     Eigen::Vector3f color = payload.color; 
     Eigen::Vector3f point = payload.view_pos;
     Eigen::Vector3f normal = payload.normal;
 
-    float kh = 0.2, kn = 0.1;
+    float kh = uniforms.kh, kn = uniforms.kn;
     
     // TODO: Implement displacement mapping here
     // Let n = normal = (x, y, z)
@@ -242,15 +348,16 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
         t.y(), b.y(), normal.y(),
         t.z(), b.z(), normal.z();
     float u = payload.tex_coords[0], v = payload.tex_coords[1];
-    auto dU = kh * kn * (payload.texture->getColor(u + 1.0f / payload.texture->width, v).norm() - payload.texture->getColor(u, v).norm());
-    auto dV = kh * kn * (payload.texture->getColor(u, v + 1.0f / payload.texture->height).norm() - payload.texture->getColor(u, v).norm());
+    Vector3f gradient = payload.texture->getGradient(u, v);
+    auto dU = kh * kn * gradient.y();
+    auto dV = kh * kn * gradient.z();
     Vector3f ln(-dU, -dV, 1.0f);
-    point = point + kn * normal * payload.texture->getColor(u, v).norm();
+    point = point + kn * normal * gradient.x();
     normal = (TBN * ln).normalized();
 
     Eigen::Vector3f result_color = {0, 0, 0};
 
-    for (auto& light : lights)
+    for (auto& light : uniforms.lights)
     {
         // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
         // components are. Then, accumulate that result on the *result_color* object.
@@ -271,25 +378,11 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
 Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
 {
     
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
-    Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
-
-    float p = 150;
-
-    Eigen::Vector3f color = payload.color; 
-    Eigen::Vector3f point = payload.view_pos;
+    const shader_uniforms& uniforms = *payload.uniforms;
     Eigen::Vector3f normal = payload.normal;
 
 
-    float kh = 0.2, kn = 0.1;
+    float kh = uniforms.kh, kn = uniforms.kn;
 
     // TODO: Implement bump mapping here
     // Let n = normal = (x, y, z)
@@ -310,8 +403,9 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
         t.y(), b.y(), normal.y(),
         t.z(), b.z(), normal.z();
     float u = payload.tex_coords[0], v = payload.tex_coords[1];
-    auto dU = kh * kn * (payload.texture->getColor(u + 1.0f / payload.texture->width, v).norm() - payload.texture->getColor(u, v).norm());
-    auto dV = kh * kn * (payload.texture->getColor(u, v + 1.0f / payload.texture->height).norm() - payload.texture->getColor(u, v).norm());
+    Vector3f gradient = payload.texture->getGradient(u, v);
+    auto dU = kh * kn * gradient.y();
+    auto dV = kh * kn * gradient.z();
     Vector3f ln(-dU, -dV, 1.0f);
     auto n = (TBN * ln).normalized();
 
@@ -322,74 +416,292 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
     return result_color * 255.f;
 }
 
+static void print_stats(const rst::frame_stats& stats)
+{
+    std::cout << "triangles: " << stats.triangles
+              << ", back faces: " << stats.backface_culled
+              << ", outside the frustum: " << stats.frustum_culled
+              << ", clipped: " << stats.clipped_triangles
+              << ", culled: " << 100.0 * stats.culled_fraction() << "%\n";
+    std::cout << "hi-z rejected blocks: " << stats.hiz_blocks
+              << ", early-z rejected fragments: " << stats.early_z_fragments
+              << ", shaded fragments: " << stats.shaded_fragments
+              << ", shader calls saved: " << stats.saved_shading() << '\n';
+}
+
+// The rasterizer's color buffer as an image, without copying it. Its
+// channels are already in OpenCV's order, so imwrite takes it as it is.
+static cv::Mat frame_image(rst::rasterizer& r)
+{
+    rst::frame_view frame = r.frame();
+    int type = frame.format == rst::ColorFormat::BGRA8 ? CV_8UC4
+             : frame.format == rst::ColorFormat::BGRA16F ? CV_16FC4 : CV_32FC3;
+    return cv::Mat(frame.height, frame.width, type, const_cast<void*>(frame.data), frame.row_bytes);
+}
+
+// What a benchmark run drew, for its report
+struct benchmark_config
+{
+    std::string mesh;
+    std::string shader;
+    bool deferred = false;
+    unsigned int threads = 0;
+    int frames = 0;
+};
+
+// The value a share q of the sorted values are at most, by nearest rank
+static double percentile(const std::vector<double>& sorted, double q)
+{
+    size_t rank = (size_t)std::ceil(q * sorted.size());
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+static std::string json_string(const std::string& s)
+{
+    std::string quoted = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            quoted += '\\';
+        quoted += c;
+    }
+    return quoted + '"';
+}
+
+// Draws config.frames frames without a window, turning the model once
+// around, and writes the frame times and the time of each stage as JSON to
+// path. The frames are drawn twice, timed whole and then with the stages
+// profiled, so the clock reads of profiling do not skew the frame times.
+template <typename Draw>
+static bool run_benchmark(rst::rasterizer& r, const Draw& draw, const benchmark_config& config, float angle,
+                          const Eigen::Vector3f& eye_pos, const std::string& path)
+{
+    int frames = config.frames;
+    auto render = [&](int frame)
+    {
+        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+        r.set_model(get_model_matrix(angle + 360.0f * frame / frames));
+        r.set_view(get_view_matrix(eye_pos));
+        r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+        draw();
+        // what would go to the encoder
+        cv::Mat image = frame_image(r);
+        return image.data != nullptr;
+    };
+
+    // caches, the pool and the texture pages warm up first
+    for (int frame = 0; frame < std::min(frames, 5); frame++)
+        render(frame);
+
+    std::vector<double> frame_ms;
+    for (int frame = 0; frame < frames; frame++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        render(frame);
+        frame_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    rst::stage_times stages;
+    double triangles = 0, fragments = 0, profiled_ms = 0;
+    r.set_profiling(true);
+    for (int frame = 0; frame < frames; frame++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        render(frame);
+        profiled_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        const rst::frame_stats& stats = r.stats();
+        stages.vertex += stats.time.vertex;
+        stages.setup += stats.time.setup;
+        stages.raster += stats.time.raster;
+        stages.depth += stats.time.depth;
+        stages.shading += stats.time.shading;
+        stages.output += stats.time.output;
+        triangles += stats.triangles;
+        fragments += stats.shaded_fragments;
+    }
+    r.set_profiling(false);
+
+    double total_ms = 0;
+    for (double ms : frame_ms)
+        total_ms += ms;
+    std::vector<double> sorted = frame_ms;
+    std::sort(sorted.begin(), sorted.end());
+    auto stage_ms = [&](long long ns) { return ns * 1e-6 / frames; };
+
+    std::ofstream out(path);
+    out << "{\n"
+        << "  \"mesh\": " << json_string(config.mesh) << ",\n"
+        << "  \"shader\": " << json_string(config.shader) << ",\n"
+        << "  \"shading\": " << json_string(config.deferred ? "deferred" : "forward") << ",\n"
+        << "  \"threads\": " << config.threads << ",\n"
+        << "  \"frames\": " << frames << ",\n"
+        << "  \"fps\": " << 1000.0 * frames / total_ms << ",\n"
+        << "  \"frame_ms\": {\"mean\": " << total_ms / frames
+        << ", \"min\": " << sorted.front()
+        << ", \"p50\": " << percentile(sorted, 0.50)
+        << ", \"p95\": " << percentile(sorted, 0.95)
+        << ", \"p99\": " << percentile(sorted, 0.99)
+        << ", \"max\": " << sorted.back() << "},\n"
+        << "  \"profiled_frame_ms\": " << profiled_ms / frames << ",\n"
+        << "  \"stage_ms\": {\"vertex\": " << stage_ms(stages.vertex)
+        << ", \"setup\": " << stage_ms(stages.setup)
+        << ", \"raster\": " << stage_ms(stages.raster)
+        << ", \"depth\": " << stage_ms(stages.depth)
+        << ", \"shading\": " << stage_ms(stages.shading)
+        << ", \"output\": " << stage_ms(stages.output) << "},\n"
+        << "  \"triangles\": " << triangles / frames << ",\n"
+        << "  \"shaded_fragments\": " << fragments / frames << "\n"
+        << "}\n";
+    return bool(out);
+}
+
+// Finds the field a sequence path numbers its frames with, one %d or %0Nd
+// with N up to 99. Returns where it starts, npos if path has no '%'. length
+// is 0 if the '%' does not start such a field or is not the only one.
+static size_t frame_field(const std::string& path, size_t& length, int& digits)
+{
+    length = 0;
+    digits = 0;
+    size_t at = path.find('%');
+    if (at == std::string::npos)
+        return at;
+    size_t end = at + 1;
+    if (end < path.size() && path[end] == '0')
+    {
+        size_t first = ++end;
+        while (end < path.size() && end - first < 2 && std::isdigit((unsigned char)path[end]))
+            digits = digits * 10 + (path[end++] - '0');
+        if (end == first)
+            return at;
+    }
+    if (end < path.size() && path[end] == 'd' && path.find('%', end) == std::string::npos)
+        length = end + 1 - at;
+    return at;
+}
+
+// Where frame number frame of a sequence goes: path with its frame field
+// replaced by the number, or with the number added before the extension.
+// The path is never used as a format, so only a valid field is replaced.
+static std::string sequence_path(const std::string& path, int frame)
+{
+    char number[32];
+    size_t length;
+    int digits;
+    size_t at = frame_field(path, length, digits);
+    if (at != std::string::npos && length > 0)
+    {
+        std::snprintf(number, sizeof(number), "%0*d", digits, frame);
+        return path.substr(0, at) + number + path.substr(at + length);
+    }
+    size_t dot = path.find_last_of('.');
+    std::snprintf(number, sizeof(number), "_%04d", frame);
+    return dot == std::string::npos ? path + number : path.substr(0, dot) + number + path.substr(dot);
+}
+
+// The part of arg after "name=", or nullptr if arg is not that option
+static const char* option_value(const char* arg, const std::string& name)
+{
+    return std::string(arg).compare(0, name.size() + 1, name + "=") == 0 ? arg + name.size() + 1 : nullptr;
+}
+
 int main(int argc, const char** argv)
 {
-    std::vector<Triangle*> TriangleList;
+    if (argc == 4 && std::string(argv[1]) == "--convert-mesh")
+    {
+        // Write an .obj file as a .mesh file, which loads without parsing
+        objl::Loader loader;
+        return loader.LoadFile(argv[2]) && objl::WriteBinaryMesh(argv[3], loader) ? 0 : 1;
+    }
 
     float angle = 140.0;
     bool command_line = false;
 
     std::string filename = "output.png";
-    objl::Loader Loader;
+    objl::BinaryMesh mesh;
     //std::string obj_path = "../models/spot/";
     std::string obj_path = "D:/Games101HomeWork/GAMES101_Homework/Assignment3/Assignment3/Code/models/spot/";
     // Load .obj File
 
 
-    bool loadout = Loader.LoadFile("D:/Games101HomeWork/GAMES101_Homework/Assignment3/Assignment3/Code/models/spot/spot_triangulated_good.obj");
-    //bool loadout = Loader.LoadFile("./models/spot/spot_triangulated_good.obj");
+    std::string mesh_path = "D:/Games101HomeWork/GAMES101_Homework/Assignment3/Assignment3/Code/models/spot/spot_triangulated_good.obj";
+    //std::string mesh_path = "./models/spot/spot_triangulated_good.obj";
+    for (int i = 3; i < argc; i++)
+        if (const char* path = option_value(argv[i], "mesh"))
+            mesh_path = path;
+    if (!mesh.Load(mesh_path) || (mesh.IsMapped() && !mesh.Verify()))
+    {
+        std::cerr << "Cannot load " << mesh_path << '\n';
+        return 1;
+    }
 
-    for(auto mesh:Loader.LoadedMeshes)
+    // Indexed vertex buffers, so each vertex is transformed once per frame
+    std::vector<Eigen::Vector3f> positions, normals, colors;
+    std::vector<Eigen::Vector2f> tex_coords;
+    std::vector<Eigen::Vector3i> indices;
+    for (size_t i = 0; i < mesh.Positions.size(); i++)
     {
-        for(int i=0;i<mesh.Vertices.size();i+=3)
-        {
-            Triangle* t = new Triangle();
-            for(int j=0;j<3;j++)
-            {
-                t->setVertex(j,Vector4f(mesh.Vertices[i+j].Position.X,mesh.Vertices[i+j].Position.Y,mesh.Vertices[i+j].Position.Z,1.0));
-                t->setNormal(j,Vector3f(mesh.Vertices[i+j].Normal.X,mesh.Vertices[i+j].Normal.Y,mesh.Vertices[i+j].Normal.Z));
-                t->setTexCoord(j,Vector2f(mesh.Vertices[i+j].TextureCoordinate.X, mesh.Vertices[i+j].TextureCoordinate.Y));
-            }
-            TriangleList.push_back(t);
-        }
+        const objl::Vector3& p = mesh.Positions[i];
+        const objl::Vector3& n = mesh.Normals[i];
+        const objl::Vector2& uv = mesh.TexCoords[i];
+        positions.emplace_back(p.X, p.Y, p.Z);
+        normals.emplace_back(n.X, n.Y, n.Z);
+        tex_coords.emplace_back(uv.X, uv.Y);
+        colors.emplace_back(148, 121, 92);
     }
+    for (size_t i = 0; i + 2 < mesh.Indices.size(); i += 3)
+        indices.emplace_back(mesh.Indices[i], mesh.Indices[i + 1], mesh.Indices[i + 2]);
 
     rst::rasterizer r(700, 700);
 
+    // The rasterizer takes the buffers over rather than copying them
+    auto pos_id = r.load_positions(std::move(positions));
+    auto ind_id = r.load_indices(std::move(indices));
+    auto col_id = r.load_colors(std::move(colors));
+    auto nor_id = r.load_normals(std::move(normals));
+    auto tex_id = r.load_tex_coords(std::move(tex_coords));
+
     auto texture_path = "hmap.jpg";
-    r.set_texture(Texture(obj_path + texture_path));
+    // The bump and displacement shaders read heights and their differences
+    // from the gradient map
+    Texture height_map(obj_path + texture_path);
+    height_map.load_gradient_map();
+    r.set_texture(height_map);
 
     std::function<Eigen::Vector3f(fragment_shader_payload)> active_shader = displacement_fragment_shader;
+    std::string shader_name = "displacement";
     //texture_path = "spot_texture.png";
     //r.set_texture(Texture(obj_path + texture_path));
     if (argc >= 2)
     {
         command_line = true;
         filename = std::string(argv[1]);
+        if (argc >= 3)
+            shader_name = argv[2];
 
-        if (argc == 3 && std::string(argv[2]) == "texture")
+        if (argc >= 3 && std::string(argv[2]) == "texture")
         {
             std::cout << "Rasterizing using the texture shader\n";
             active_shader = texture_fragment_shader;
             texture_path = "spot_texture.png";
             r.set_texture(Texture(obj_path + texture_path));
         }
-        else if (argc == 3 && std::string(argv[2]) == "normal")
+        else if (argc >= 3 && std::string(argv[2]) == "normal")
         {
             std::cout << "Rasterizing using the normal shader\n";
             active_shader = normal_fragment_shader;
         }
-        else if (argc == 3 && std::string(argv[2]) == "phong")
+        else if (argc >= 3 && std::string(argv[2]) == "phong")
         {
             std::cout << "Rasterizing using the phong shader\n";
             active_shader = phong_fragment_shader;
         }
-        else if (argc == 3 && std::string(argv[2]) == "bump")
+        else if (argc >= 3 && std::string(argv[2]) == "bump")
         {
             std::cout << "Rasterizing using the bump shader\n";
             active_shader = bump_fragment_shader;
         }
-        else if (argc == 3 && std::string(argv[2]) == "displacement")
+        else if (argc >= 3 && std::string(argv[2]) == "displacement")
         {
             std::cout << "Rasterizing using the bump shader\n";
             active_shader = displacement_fragment_shader;
@@ -398,12 +710,132 @@ int main(int argc, const char** argv)
 
     Eigen::Vector3f eye_pos = {0,0,10};
 
+    shader_uniforms uniforms;
+    uniforms.eye_pos = eye_pos;
+    uniforms.lights.push_back(light{{20, 20, 20}, {500, 500, 500}});
+    uniforms.lights.push_back(light{{-20, 20, 0}, {500, 500, 500}});
+    r.set_uniforms(uniforms);
+
     r.set_vertex_shader(vertex_shader);
     r.set_fragment_shader(active_shader);
+    // spot is closed, its back faces are always hidden
+    r.set_culling(rst::Culling::Back);
+
+    bool packet_shaders = true;
+    rst::Primitive primitive = rst::Primitive::Triangle;
+    benchmark_config benchmark;
+    benchmark.mesh = mesh_path;
+    benchmark.shader = shader_name;
+    // frames=N captures a sequence turning the model once around
+    int sequence_frames = 0;
+    FrameWriter::Policy write_policy = FrameWriter::Policy::Block;
+    for (int i = 3; i < argc; i++)
+    {
+        if (std::string(argv[i]) == "deferred")
+        {
+            std::cout << "Shading the visible fragments only\n";
+            r.set_shading(rst::Shading::Deferred);
+            benchmark.deferred = true;
+        }
+        else if (std::string(argv[i]) == "nocull")
+        {
+            std::cout << "Drawing back faces\n";
+            r.set_culling(rst::Culling::None);
+        }
+        else if (std::string(argv[i]) == "function")
+        {
+            std::cout << "Shading through std::function\n";
+            packet_shaders = false;
+        }
+        else if (std::string(argv[i]) == "wireframe")
+        {
+            std::cout << "Drawing the edges of the triangles\n";
+            primitive = rst::Primitive::Line;
+        }
+        else if (std::string(argv[i]) == "rgba16f")
+        {
+            std::cout << "Storing colors as half floats\n";
+            r.set_color_format(rst::ColorFormat::BGRA16F);
+        }
+        else if (std::string(argv[i]) == "rgb32f")
+        {
+            std::cout << "Storing colors as floats\n";
+            r.set_color_format(rst::ColorFormat::BGR32F);
+        }
+        else if (const char* threads = option_value(argv[i], "threads"))
+        {
+            benchmark.threads = std::stoi(threads);
+            r.set_threads(benchmark.threads);
+        }
+        else if (const char* frames = option_value(argv[i], "benchmark"))
+        {
+            benchmark.frames = std::stoi(frames);
+        }
+        else if (const char* frames = option_value(argv[i], "frames"))
+        {
+            sequence_frames = std::stoi(frames);
+        }
+        else if (std::string(argv[i]) == "drop")
+        {
+            std::cout << "Dropping the frames the writer cannot keep up with\n";
+            write_policy = FrameWriter::Policy::Drop;
+        }
+    }
+    if (benchmark.threads == 0)
+        benchmark.threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // Shaders with a packet version are drawn through it
+    auto draw = [&]()
+    {
+        if (packet_shaders && shader_name == "normal")
+            r.draw(pos_id, ind_id, col_id, nor_id, tex_id, primitive, normal_packet_shader{});
+        else if (packet_shaders && shader_name == "phong")
+            r.draw(pos_id, ind_id, col_id, nor_id, tex_id, primitive, phong_packet_shader{});
+        else if (packet_shaders && shader_name == "texture")
+            r.draw(pos_id, ind_id, col_id, nor_id, tex_id, primitive, texture_packet_shader{});
+        else
+            r.draw(pos_id, ind_id, col_id, nor_id, tex_id, primitive);
+    };
 
     int key = 0;
     int frame_count = 0;
 
+    if (benchmark.frames > 0)
+    {
+        std::cout << "Benchmarking " << benchmark.frames << " frames into " << filename << '\n';
+        return run_benchmark(r, draw, benchmark, angle, eye_pos, filename) ? 0 : 1;
+    }
+
+    if (sequence_frames > 0)
+    {
+        size_t field_length;
+        int field_digits;
+        if (frame_field(filename, field_length, field_digits) != std::string::npos && field_length == 0)
+        {
+            std::cerr << "A sequence path numbers its frames with one %d or %0Nd: " << filename << '\n';
+            return 1;
+        }
+
+        // Frames are encoded on the writer's thread while the next ones draw
+        FrameWriter writer(4, write_policy);
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < sequence_frames; frame++)
+        {
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            r.set_model(get_model_matrix(angle + 360.0f * frame / sequence_frames));
+            r.set_view(get_view_matrix(eye_pos));
+            r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+            draw();
+            writer.write(sequence_path(filename, frame), frame_image(r));
+        }
+        double render_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        writer.flush();
+        double total_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << sequence_frames << " frames rendered in " << render_s << " s, written in " << total_s
+                  << " s, dropped: " << writer.dropped() << ", failed: " << writer.failed() << '\n';
+        return writer.failed() == 0 ? 0 : 1;
+    }
+
     if (command_line)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
@@ -411,16 +843,15 @@ int main(int argc, const char** argv)
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
-
-        cv::imwrite(filename, image);
+        draw();
+        print_stats(r.stats());
+        cv::imwrite(filename, frame_image(r));
 
         return 0;
     }
 
+    // The window shows every frame, the file only has to keep up now and then
+    FrameWriter writer(2, FrameWriter::Policy::Drop);
     while(key != 27)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
@@ -429,14 +860,15 @@ int main(int argc, const char** argv)
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
-        //r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
-
+        //r.draw(pos_id, ind_id, col_id, nor_id, tex_id, rst::Primitive::Triangle);
+        draw();
+        print_stats(r.stats());
+        cv::Mat image = frame_image(r);
+        // imshow takes floats as 0 to 1 and no half floats at all
+        if (image.depth() != CV_8U)
+            image.convertTo(image, CV_8U);
         cv::imshow("image", image);
-        cv::imwrite(filename, image);
+        writer.write(filename, image);
         key = cv::waitKey(10);
 
         if (key == 'a' )
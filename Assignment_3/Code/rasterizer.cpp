@@ -3,272 +3,756 @@
 //
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
 
-
-rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
+namespace
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
+    long long clock_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // What cv::saturate_cast<uchar> makes of a float
+    uint8_t to_byte(float c)
+    {
+        if (!(c > 0))
+            return 0;
+        if (c >= 255)
+            return 255;
+        return (uint8_t)std::lrint(c);
+    }
 
-    return {id};
+    // IEEE half float, rounded to nearest even
+    uint16_t to_half(float f)
+    {
+#if defined(__F16C__)
+        return (uint16_t)_cvtss_sh(f, 0);
+#else
+        uint32_t x;
+        std::memcpy(&x, &f, sizeof(x));
+        uint32_t sign = x & 0x80000000u;
+        x ^= sign;
+        uint16_t h;
+        if (x >= (127u + 16) << 23)
+        {
+            // too large for a half, infinite or NaN
+            h = x > 255u << 23 ? 0x7E00 : 0x7C00;
+        }
+        else if (x < 113u << 23)
+        {
+            // a subnormal half: adding the magic number shifts the mantissa
+            // into place and rounds it with the float addition
+            const uint32_t magic_bits = (127u - 15 + 23 - 10 + 1) << 23;
+            float magic, sum;
+            std::memcpy(&magic, &magic_bits, sizeof(magic));
+            std::memcpy(&sum, &x, sizeof(sum));
+            sum += magic;
+            uint32_t bits;
+            std::memcpy(&bits, &sum, sizeof(bits));
+            h = (uint16_t)(bits - magic_bits);
+        }
+        else
+        {
+            // rebias the exponent and round the 13 dropped bits to even
+            uint32_t odd = (x >> 13) & 1;
+            x += ((15u - 127u) << 23) + 0xFFF + odd;
+            h = (uint16_t)(x >> 13);
+        }
+        return (uint16_t)(h | sign >> 16);
+#endif
+    }
 }
 
-rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+
+rst::pos_buf_id rst::rasterizer::load_positions(std::vector<Eigen::Vector3f> positions)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
+    return {pos_buf.add(std::move(positions))};
+}
 
-    return {id};
+rst::pos_buf_id rst::rasterizer::load_positions(buffer_span<Eigen::Vector3f> positions)
+{
+    return {pos_buf.adopt(positions)};
 }
 
-rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
+rst::ind_buf_id rst::rasterizer::load_indices(std::vector<Eigen::Vector3i> indices)
 {
-    auto id = get_next_id();
-    col_buf.emplace(id, cols);
+    edge_buf.add(unique_edges(indices.data(), indices.size()));
+    return {ind_buf.add(std::move(indices))};
+}
 
-    return {id};
+rst::ind_buf_id rst::rasterizer::load_indices(buffer_span<Eigen::Vector3i> indices)
+{
+    edge_buf.add(unique_edges(indices.data, indices.count));
+    return {ind_buf.adopt(indices)};
 }
 
-rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f>& normals)
+rst::col_buf_id rst::rasterizer::load_colors(std::vector<Eigen::Vector3f> cols)
 {
-    auto id = get_next_id();
-    nor_buf.emplace(id, normals);
+    return {col_buf.add(std::move(cols))};
+}
 
-    normal_id = id;
+rst::col_buf_id rst::rasterizer::load_colors(buffer_span<Eigen::Vector3f> cols)
+{
+    return {col_buf.adopt(cols)};
+}
 
-    return {id};
+rst::nor_buf_id rst::rasterizer::load_normals(std::vector<Eigen::Vector3f> normals)
+{
+    return {nor_buf.add(std::move(normals))};
 }
 
+rst::nor_buf_id rst::rasterizer::load_normals(buffer_span<Eigen::Vector3f> normals)
+{
+    return {nor_buf.adopt(normals)};
+}
 
-// Bresenham's line drawing algorithm
-void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
+rst::tex_buf_id rst::rasterizer::load_tex_coords(std::vector<Eigen::Vector2f> tex_coords)
 {
-    auto x1 = begin.x();
-    auto y1 = begin.y();
-    auto x2 = end.x();
-    auto y2 = end.y();
+    return {tex_buf.add(std::move(tex_coords))};
+}
 
-    Eigen::Vector3f line_color = {255, 255, 255};
+rst::tex_buf_id rst::rasterizer::load_tex_coords(buffer_span<Eigen::Vector2f> tex_coords)
+{
+    return {tex_buf.adopt(tex_coords)};
+}
 
-    int x,y,dx,dy,dx1,dy1,px,py,xe,ye,i;
 
-    dx=x2-x1;
-    dy=y2-y1;
-    dx1=fabs(dx);
-    dy1=fabs(dy);
-    px=2*dy1-dx1;
-    py=2*dx1-dy1;
+auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
+{
+    return Vector4f(v3.x(), v3.y(), v3.z(), w);
+}
 
-    if(dy1<=dx1)
+namespace
+{
+    // Runs a std::function fragment shader on each lane of a packet
+    struct function_shader
     {
-        if(dx>=0)
-        {
-            x=x1;
-            y=y1;
-            xe=x2;
-        }
-        else
-        {
-            x=x2;
-            y=y2;
-            xe=x1;
-        }
-        Eigen::Vector2i point = Eigen::Vector2i(x, y);
-        set_pixel(point,line_color);
-        for(i=0;x<xe;i++)
+        const std::function<Eigen::Vector3f(fragment_shader_payload)>* shader;
+
+        void operator()(const fragment_packet& in, color_packet& out) const
         {
-            x=x+1;
-            if(px<0)
+            for (int k = 0; k < in.count; ++k)
             {
-                px=px+2*dy1;
+                fragment_shader_payload payload(Eigen::Vector3f(in.color[0][k], in.color[1][k], in.color[2][k]),
+                                                Eigen::Vector3f(in.normal[0][k], in.normal[1][k], in.normal[2][k]),
+                                                Eigen::Vector2f(in.tex_coords[0][k], in.tex_coords[1][k]),
+                                                in.texture);
+                payload.view_pos = Eigen::Vector3f(in.view_pos[0][k], in.view_pos[1][k], in.view_pos[2][k]);
+                payload.tex_dx = Eigen::Vector2f(in.tex_dx[0][k], in.tex_dx[1][k]);
+                payload.tex_dy = Eigen::Vector2f(in.tex_dy[0][k], in.tex_dy[1][k]);
+                payload.uniforms = in.uniforms;
+                Eigen::Vector3f color = (*shader)(payload);
+                out.color[0][k] = color.x();
+                out.color[1][k] = color.y();
+                out.color[2][k] = color.z();
             }
-            else
+        }
+    };
+}
+
+void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList)
+{
+    draw(TriangleList, function_shader{&fragment_shader});
+}
+
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, nor_buf_id nor_buffer,
+                          tex_buf_id tex_buffer, Primitive type)
+{
+    draw(pos_buffer, ind_buffer, col_buffer, nor_buffer, tex_buffer, type, function_shader{&fragment_shader});
+}
+
+void rst::rasterizer::draw_packets(std::vector<Triangle *> &TriangleList, packet_kernel packet_shader, const void* shader)
+{
+    kernel = packet_shader;
+    kernel_shader = shader;
+
+    Eigen::Matrix4f mv = view * model;
+    Eigen::Matrix4f mvp = projection * mv;
+    Eigen::Matrix4f inv_trans = mv.inverse().transpose();
+    begin_clipping();
+
+    // Every chunk of triangles is transformed, assembled and binned by one
+    // worker
+    int count = TriangleList.size();
+    int chunks = begin_binning(count);
+    // The vertices are transformed as they are assembled, so their time
+    // counts as setup
+    parallel_for(chunks, [&](int chunk) {
+        long long start = profiling ? clock_ns() : 0;
+        int begin = (long long)count * chunk / chunks;
+        int end = (long long)count * (chunk + 1) / chunks;
+        for (int k = begin; k < end; ++k)
+        {
+            const Triangle* t = TriangleList[k];
+
+            clip_vertex v[3];
+            unsigned int codes[3];
+            for (int i = 0; i < 3; ++i)
             {
-                if((dx<0 && dy<0) || (dx>0 && dy>0))
-                {
-                    y=y+1;
-                }
-                else
-                {
-                    y=y-1;
-                }
-                px=px+2*(dy1-dx1);
+                v[i].clip = mvp * t->v[i];
+                v[i].screen = to_screen(v[i].clip);
+                v[i].view_pos = (mv * t->v[i]).head<3>();
+                //view space normal
+                v[i].normal = (inv_trans * to_vec4(t->normal[i], 0.0f)).head<3>();
+                v[i].color = Vector3f(148/255., 121/255., 92/255.);
+                v[i].tex_coords = t->tex_coords[i];
+                codes[i] = outcode(v[i].clip);
             }
-//            delay(0);
-            Eigen::Vector2i point = Eigen::Vector2i(x, y);
-            set_pixel(point,line_color);
+
+            assemble_triangle(assembled[chunk], v, codes);
         }
-    }
-    else
+        if (profiling)
+            assembled[chunk].counts.time.setup += clock_ns() - start;
+    });
+
+    raster_stage(chunks);
+}
+
+void rst::rasterizer::draw_indexed(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer,
+                                   nor_buf_id nor_buffer, tex_buf_id tex_buffer, Primitive type,
+                                   packet_kernel packet_shader, const void* shader)
+{
+    buffer_span<Eigen::Vector3f> buf = pos_buf[pos_buffer.pos_id];
+    if (type == rst::Primitive::Line)
     {
-        if(dy>=0)
+        draw_wireframe(buf, edge_buf[ind_buffer.ind_id]);
+        return;
+    }
+    kernel = packet_shader;
+    kernel_shader = shader;
+
+    buffer_span<Eigen::Vector3i> ind = ind_buf[ind_buffer.ind_id];
+    buffer_span<Eigen::Vector3f> col = col_buf[col_buffer.col_id];
+    buffer_span<Eigen::Vector3f> nor = nor_buf[nor_buffer.nor_id];
+    buffer_span<Eigen::Vector2f> tex = tex_buf[tex_buffer.tex_id];
+
+    // Per draw uniforms
+    Eigen::Matrix4f mv = view * model;
+    Eigen::Matrix4f mvp = projection * mv;
+    Eigen::Matrix4f inv_trans = mv.inverse().transpose();
+    begin_clipping();
+
+    // Vertex stage: the vertex shader and transforms run once per vertex,
+    // however many triangles share it
+    int vertex_count = buf.size();
+    vertex_cache.resize(vertex_count);
+    int vertex_chunks = std::max(1, std::min(vertex_count / 256, (pool ? (int)pool->size() : 1) * 4));
+    parallel_for(vertex_chunks, [&](int chunk) {
+        long long start = profiling ? clock_ns() : 0;
+        int begin = (long long)vertex_count * chunk / vertex_chunks;
+        int end = (long long)vertex_count * (chunk + 1) / vertex_chunks;
+        for (int i = begin; i < end; ++i)
         {
-            x=x1;
-            y=y1;
-            ye=y2;
+            vertex_shader_payload payload;
+            payload.position = buf[i];
+            Eigen::Vector4f position = to_vec4(vertex_shader ? vertex_shader(payload) : payload.position, 1.0f);
+
+            shaded_vertex& out = vertex_cache[i];
+            out.view_pos = (mv * position).head<3>();
+            out.clip = mvp * position;
+            out.screen = to_screen(out.clip);
+            out.outcode = outcode(out.clip);
+
+            //view space normal
+            out.normal = Eigen::Vector3f::Zero();
+            if (i < (int)nor.size())
+                out.normal = (inv_trans * to_vec4(nor[i], 0.0f)).head<3>();
         }
-        else
+        if (profiling)
         {
-            x=x2;
-            y=y2;
-            ye=y1;
+            frame_stats chunk_counts;
+            chunk_counts.time.vertex = clock_ns() - start;
+            add_counts(chunk_counts);
         }
-        Eigen::Vector2i point = Eigen::Vector2i(x, y);
-        set_pixel(point,line_color);
-        for(i=0;y<ye;i++)
+    });
+
+    // Primitive assembly from the transformed vertices, then binning
+    int count = ind.size();
+    int chunks = begin_binning(count);
+    parallel_for(chunks, [&](int chunk) {
+        long long start = profiling ? clock_ns() : 0;
+        int begin = (long long)count * chunk / chunks;
+        int end = (long long)count * (chunk + 1) / chunks;
+        for (int k = begin; k < end; ++k)
         {
-            y=y+1;
-            if(py<=0)
-            {
-                py=py+2*dx1;
-            }
-            else
+            clip_vertex v[3];
+            unsigned int codes[3];
+            for (int i = 0; i < 3; ++i)
             {
-                if((dx<0 && dy<0) || (dx>0 && dy>0))
-                {
-                    x=x+1;
-                }
-                else
-                {
-                    x=x-1;
-                }
-                py=py+2*(dx1-dy1);
+                int index = ind[k][i];
+                const shaded_vertex& vertex = vertex_cache[index];
+                v[i].clip = vertex.clip;
+                v[i].screen = vertex.screen;
+                v[i].view_pos = vertex.view_pos;
+                v[i].normal = vertex.normal;
+                codes[i] = vertex.outcode;
+
+                // colors are 0 to 255 like Triangle::setColor's
+                Eigen::Vector3f c = index < (int)col.size() ? col[index] : Eigen::Vector3f(0, 0, 0);
+                v[i].color = Vector3f((float)c.x()/255., (float)c.y()/255., (float)c.z()/255.);
+                v[i].tex_coords = index < (int)tex.size() ? tex[index] : Eigen::Vector2f(0, 0);
             }
-//            delay(0);
-            Eigen::Vector2i point = Eigen::Vector2i(x, y);
-            set_pixel(point,line_color);
+
+            assemble_triangle(assembled[chunk], v, codes);
         }
-    }
+        if (profiling)
+            assembled[chunk].counts.time.setup += clock_ns() - start;
+    });
+
+    raster_stage(chunks);
 }
 
-auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
+void rst::rasterizer::draw_wireframe(buffer_span<Eigen::Vector3f> positions, buffer_span<mesh_edge> edges)
 {
-    return Vector4f(v3.x(), v3.y(), v3.z(), w);
+    Eigen::Matrix4f mvp = projection * view * model;
+    // the wireframe's near plane, not the clip_plane of the same name
+    rst::near_plane near(projection);
+
+    int vertex_count = positions.size();
+    wire_vertices.resize(vertex_count);
+    int vertex_chunks = std::max(1, std::min(vertex_count / 256, (pool ? (int)pool->size() : 1) * 4));
+    parallel_for(vertex_chunks, [&](int chunk) {
+        int begin = (long long)vertex_count * chunk / vertex_chunks;
+        int end = (long long)vertex_count * (chunk + 1) / vertex_chunks;
+        for (int i = begin; i < end; ++i)
+        {
+            vertex_shader_payload payload;
+            payload.position = positions[i];
+            Eigen::Vector4f position = to_vec4(vertex_shader ? vertex_shader(payload) : payload.position, 1.0f);
+            wire_vertices[i] = project_vertex(mvp * position, near, width, height);
+        }
+    });
+
+    // Rows of frame_buf run from the top of the screen down
+    const Eigen::Vector3f line_color = {255, 255, 255};
+    uint32_t* origin = &frame_buf[size_t(height - 1) * width * words_per_pixel];
+    std::ptrdiff_t row_step = -std::ptrdiff_t(width) * words_per_pixel;
+    for (const mesh_edge& edge : edges)
+    {
+        line_segment line;
+        if (!project_edge(wire_vertices[edge.a], wire_vertices[edge.b], near, width, height, line))
+            continue;
+        // the pending clears of the tiles the line may cross go first
+        int tx0 = std::min(line.x0, line.x1) / tile_size, tx1 = std::max(line.x0, line.x1) / tile_size;
+        int ty0 = std::min(line.y0, line.y1) / tile_size, ty1 = std::max(line.y0, line.y1) / tile_size;
+        for (int ty = ty0; ty <= ty1; ++ty)
+            for (int tx = tx0; tx <= tx1; ++tx)
+                begin_tile(ty * tiles_x + tx);
+        draw_segment(origin, words_per_pixel, row_step, line, 0, height, [&](uint32_t& pixel) {
+            store_color(int((&pixel - frame_buf.data()) / words_per_pixel), line_color);
+        });
+    }
 }
 
-static bool insideTriangle(float x, float y, const Vector4f* _v){
-    Vector3f v[3];
-    for(int i=0;i<3;i++)
-        v[i] = {_v[i].x(),_v[i].y(), 1.0};
-    Vector3f f0,f1,f2;
-    f0 = v[1].cross(v[0]);
-    f1 = v[2].cross(v[1]);
-    f2 = v[0].cross(v[2]);
-    Vector3f p(x,y,1.);
-    if((p.dot(f0)*f0.dot(v[2])>0) && (p.dot(f1)*f1.dot(v[0])>0) && (p.dot(f2)*f2.dot(v[1])>0))
-        return true;
-    return false;
+void rst::rasterizer::begin_clipping()
+{
+    const Eigen::Matrix4f& p = projection;
+    facing = 1.0f;
+    w_near = 0.0f;
+    w_far = std::numeric_limits<float>::infinity();
+
+    // A perspective projection makes w proportional to the view space z,
+    // and the camera looks down -z
+    if (p(3, 0) == 0 && p(3, 1) == 0 && p(3, 3) == 0 && p(3, 2) != 0)
+    {
+        facing = p(3, 2) < 0 ? 1.0f : -1.0f;
+
+        // The depths where z / w is -1 and 1 are the near and far planes.
+        // This assignment's projection puts them behind the camera, at the
+        // mirror image of the view volume, so only their distance is used.
+        float z0 = p(2, 3) / (-p(3, 2) - p(2, 2));
+        float z1 = p(2, 3) / (p(3, 2) - p(2, 2));
+        float w0 = std::abs(p(3, 2) * z0), w1 = std::abs(p(3, 2) * z1);
+        if (std::isfinite(w0) && std::isfinite(w1) && std::min(w0, w1) > 0)
+        {
+            w_near = std::min(w0, w1);
+            w_far = std::max(w0, w1);
+        }
+        else
+        {
+            w_near = 1e-5f * std::abs(p(3, 2));
+        }
+    }
+
+    // Keeps clipped vertices inside triangle_edges::guard_band pixels
+    guard = triangle_edges::guard_band / (2.0f * std::max(width, height));
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector4f* v){
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+unsigned int rst::rasterizer::outcode(const Eigen::Vector4f& p) const
+{
+    unsigned int code = 0;
+    for (int plane = 0; plane < clip_planes; ++plane)
+        if (plane_distance(plane, p) < 0)
+            code |= 1u << plane;
+    return code;
 }
 
-void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
+float rst::rasterizer::plane_distance(int plane, const Eigen::Vector4f& p) const
+{
+    float w = facing * p.w();
+    switch (plane)
+    {
+        case near_plane: return w - w_near;
+        case far_plane: return w_far - w;
+        case left_plane: return w + p.x();
+        case right_plane: return w - p.x();
+        case bottom_plane: return w + p.y();
+        case top_plane: return w - p.y();
+        case left_guard: return guard * w + p.x();
+        case right_guard: return guard * w - p.x();
+        case bottom_guard: return guard * w + p.y();
+        case top_guard: return guard * w - p.y();
+    }
+    return 0;
+}
 
+Eigen::Vector4f rst::rasterizer::to_screen(const Eigen::Vector4f& p) const
+{
     float f1 = (50 - 0.1) / 2.0;
     float f2 = (50 + 0.1) / 2.0;
 
-    Eigen::Matrix4f mvp = projection * view * model;
-    for (const auto& t:TriangleList)
-    {
-        Triangle newtri = *t;
-
-        std::array<Eigen::Vector4f, 3> mm {
-                (view * model * t->v[0]),
-                (view * model * t->v[1]),
-                (view * model * t->v[2])
-        };
+    Eigen::Vector4f v = p;
+    //Homogeneous division
+    v.x()/=v.w();
+    v.y()/=v.w();
+    v.z()/=v.w();
+    //Viewport transformation
+    v.x() = 0.5*width*(v.x()+1.0);
+    v.y() = 0.5*height*(v.y()+1.0);
+    v.z() = v.z() * f1 + f2;
+    return v;
+}
 
-        std::array<Eigen::Vector3f, 3> viewspace_pos;
+void rst::rasterizer::assemble_triangle(triangle_chunk& chunk, const clip_vertex* v, const unsigned int* codes)
+{
+    chunk.counts.triangles++;
 
-        std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
-            return v.template head<3>();
-        });
+    // All three vertices outside the same plane
+    if (codes[0] & codes[1] & codes[2])
+    {
+        chunk.counts.frustum_culled++;
+        return;
+    }
 
-        Eigen::Vector4f v[] = {
-                mvp * t->v[0],
-                mvp * t->v[1],
-                mvp * t->v[2]
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec.x()/=vec.w();
-            vec.y()/=vec.w();
-            vec.z()/=vec.w();
-        }
+    unsigned int cut = (codes[0] | codes[1] | codes[2]) & cutting_planes;
+    if (cut == 0)
+    {
+        if (!add_triangle(chunk, v[0], v[1], v[2]))
+            chunk.counts.backface_culled++;
+        return;
+    }
 
-        Eigen::Matrix4f inv_trans = (view * model).inverse().transpose();
-        Eigen::Vector4f n[] = {
-                inv_trans * to_vec4(t->normal[0], 0.0f),
-                inv_trans * to_vec4(t->normal[1], 0.0f),
-                inv_trans * to_vec4(t->normal[2], 0.0f)
-        };
+    // Sutherland-Hodgman against each plane the triangle crosses; every
+    // plane adds at most one vertex
+    std::array<clip_vertex, 3 + clip_planes> polygon, next;
+    std::copy(v, v + 3, polygon.begin());
+    int n = 3;
+    for (int plane = 0; plane < clip_planes && n >= 3; ++plane)
+    {
+        if (!(cut & 1u << plane))
+            continue;
 
-        //Viewport transformation
-        for (auto & vert : v)
+        int m = 0;
+        for (int i = 0; i < n; ++i)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            const clip_vertex& a = polygon[i];
+            const clip_vertex& b = polygon[(i + 1) % n];
+            float da = plane_distance(plane, a.clip), db = plane_distance(plane, b.clip);
+            if (da >= 0)
+                next[m++] = a;
+            if ((da >= 0) != (db >= 0))
+            {
+                float s = da / (da - db);
+                clip_vertex& c = next[m++];
+                c.clip = a.clip + s * (b.clip - a.clip);
+                c.view_pos = a.view_pos + s * (b.view_pos - a.view_pos);
+                c.normal = a.normal + s * (b.normal - a.normal);
+                c.color = a.color + s * (b.color - a.color);
+                c.tex_coords = a.tex_coords + s * (b.tex_coords - a.tex_coords);
+            }
         }
+        std::swap(polygon, next);
+        n = m;
+    }
+    if (n < 3)
+    {
+        chunk.counts.frustum_culled++;
+        return;
+    }
 
-        for (int i = 0; i < 3; ++i)
+    chunk.counts.clipped_triangles++;
+    for (int i = 0; i < n; ++i)
+        polygon[i].screen = to_screen(polygon[i].clip);
+    // the pieces of a planar polygon all face the same way
+    for (int i = 1; i + 1 < n; ++i)
+    {
+        if (!add_triangle(chunk, polygon[0], polygon[i], polygon[i + 1]))
         {
-            //screen space coordinates
-            newtri.setVertex(i, v[i]);
+            chunk.counts.backface_culled++;
+            return;
         }
+    }
+}
 
-        for (int i = 0; i < 3; ++i)
-        {
-            //view space normal
-            newtri.setNormal(i, n[i].head<3>());
-        }
+bool rst::rasterizer::add_triangle(triangle_chunk& chunk, const clip_vertex& a, const clip_vertex& b, const clip_vertex& c)
+{
+    if (culling == Culling::Back)
+    {
+        // counter clockwise on screen faces the camera
+        float area = (b.screen.x() - a.screen.x()) * (c.screen.y() - a.screen.y()) -
+                     (b.screen.y() - a.screen.y()) * (c.screen.x() - a.screen.x());
+        if (area < 0)
+            return false;
+    }
+
+    Triangle& t = chunk.tris.emplace_back();
+    std::array<Eigen::Vector3f, 3>& view_pos = chunk.view_pos.emplace_back();
+    const clip_vertex* v[] = { &a, &b, &c };
+    for (int i = 0; i < 3; ++i)
+    {
+        //screen space coordinates
+        t.v[i] = v[i]->screen;
+        t.normal[i] = v[i]->normal;
+        t.color[i] = v[i]->color;
+        t.tex_coords[i] = v[i]->tex_coords;
+        view_pos[i] = v[i]->view_pos;
+    }
 
-        newtri.setColor(0, 148,121.0,92.0);
-        newtri.setColor(1, 148,121.0,92.0);
-        newtri.setColor(2, 148,121.0,92.0);
+    bin_triangle(chunk);
+    return true;
+}
 
-        // Also pass view space vertice position
-        rasterize_triangle(newtri, viewspace_pos);
+int rst::rasterizer::begin_binning(int count)
+{
+    // Each chunk of triangles is assembled by one worker into its own
+    // bins, so submission order survives binning
+    int workers = pool ? pool->size() : 1;
+    int chunks = std::max(1, std::min(count, workers * 4));
+    if ((int)assembled.size() < chunks)
+        assembled.resize(chunks);
+    for (int chunk = 0; chunk < chunks; ++chunk)
+    {
+        triangle_chunk& c = assembled[chunk];
+        c.tris.clear();
+        c.view_pos.clear();
+        c.bins.resize(tiles_x * tiles_y);
+        for (auto& bin : c.bins)
+            bin.clear();
+        c.counts = frame_stats();
     }
+    return chunks;
 }
 
-static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
+void rst::rasterizer::bin_triangle(triangle_chunk& chunk)
 {
-    return (alpha * vert1 + beta * vert2 + gamma * vert3) / weight;
+    int k = chunk.tris.size() - 1;
+    const Vector4f* v = chunk.tris[k].v;
+
+    // The pixels the rasterizer visits are floor(l) <= x < r and
+    // floor(b) <= y < u, clipped to the screen
+    float l = std::min({v[0].x(), v[1].x(), v[2].x()});
+    float r = std::max({v[0].x(), v[1].x(), v[2].x()});
+    float b = std::min({v[0].y(), v[1].y(), v[2].y()});
+    float u = std::max({v[0].y(), v[1].y(), v[2].y()});
+    l = std::max(l, 0.0f);
+    b = std::max(b, 0.0f);
+    r = std::min(r, (float)width);
+    u = std::min(u, (float)height);
+    // also false for NaN coordinates
+    if (!(l < r && b < u))
+        return;
+
+    int tx0 = (int)std::floor(l) / tile_size, tx1 = ((int)std::ceil(r) - 1) / tile_size;
+    int ty0 = (int)std::floor(b) / tile_size, ty1 = ((int)std::ceil(u) - 1) / tile_size;
+    for (int ty = ty0; ty <= ty1; ++ty)
+        for (int tx = tx0; tx <= tx1; ++tx)
+            chunk.bins[ty * tiles_x + tx].push_back(k);
 }
 
-static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f& vert1, const Eigen::Vector2f& vert2, const Eigen::Vector2f& vert3, float weight)
+void rst::rasterizer::raster_stage(int chunks)
 {
-    auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
-    auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
+    for (int chunk = 0; chunk < chunks; ++chunk)
+        add_counts(assembled[chunk].counts);
 
-    u /= weight;
-    v /= weight;
+    // Tiles are independent, so workers never share a pixel
+    parallel_for(tiles_x * tiles_y, [&](int tile) { rasterize_tile(tile, chunks); });
 
-    return Eigen::Vector2f(u, v);
+    // Deferred shading stage: each pixel written above is shaded once
+    if (shading == Shading::Deferred)
+        parallel_for(tiles_x * tiles_y, [&](int tile) { shade_tile(tile); });
+}
+
+void rst::rasterizer::rasterize_tile(int tile, int chunks)
+{
+    int x0 = tile % tiles_x * tile_size;
+    int y0 = tile / tiles_x * tile_size;
+    int x1 = std::min(x0 + tile_size, width);
+    int y1 = std::min(y0 + tile_size, height);
+
+    // Tiles no triangle overlaps keep their pending clears
+    bool binned = false;
+    for (int chunk = 0; chunk < chunks && !binned; ++chunk)
+        binned = !assembled[chunk].bins[tile].empty();
+    if (!binned)
+        return;
+
+    frame_stats tile_counts;
+    long long start = profiling ? clock_ns() : 0;
+    begin_tile(tile, &tile_counts);
+
+    fragment_batch batch;
+    batch.packet.texture = texture ? &*texture : nullptr;
+    batch.packet.uniforms = &uniforms;
+    for (int chunk = 0; chunk < chunks; ++chunk)
+    {
+        const triangle_chunk& c = assembled[chunk];
+        for (int k : c.bins[tile])
+            rasterize_triangle(c.tris[k], c.view_pos[k], x0, y0, x1, y1, batch, tile_counts);
+    }
+    flush(batch, tile_counts);
+
+    // what the clears and the shader did not take
+    if (profiling)
+    {
+        stage_times& t = tile_counts.time;
+        t.raster = clock_ns() - start - t.depth - t.output - t.shading;
+    }
+    add_counts(tile_counts);
 }
 
+void rst::rasterizer::shade_tile(int tile)
+{
+    int x0 = tile % tiles_x * tile_size;
+    int y0 = tile / tiles_x * tile_size;
+    int x1 = std::min(x0 + tile_size, width);
+    int y1 = std::min(y0 + tile_size, height);
+
+    frame_stats tile_counts;
+    long long start = profiling ? clock_ns() : 0;
+    fragment_batch batch;
+    batch.packet.texture = texture ? &*texture : nullptr;
+    batch.packet.uniforms = &uniforms;
+    for (int j = y0; j < y1; j++)
+    {
+        for (int i = x0; i < x1; i++)
+        {
+            int index = get_index(i, j);
+            if (!gbuffer_written[index])
+                continue;
+            gbuffer_written[index] = 0;
+
+            const gbuffer_texel& g = gbuffer[index];
+            emit(batch, i, j, g.view_pos, g.normal, g.tex_coords, g.tex_dx, g.tex_dy, g.color, tile_counts);
+        }
+    }
+    flush(batch, tile_counts);
+    // reading the G-buffer is part of shading too
+    if (profiling)
+        tile_counts.time.shading = clock_ns() - start;
+    add_counts(tile_counts);
+}
 
-float interpolate(float x, float y, const Triangle& t)
+void rst::rasterizer::emit(fragment_batch& batch, int x, int y, const Eigen::Vector3f& view_pos, const Eigen::Vector3f& normal,
+                           const Eigen::Vector2f& tex_coords, const Eigen::Vector2f& tex_dx, const Eigen::Vector2f& tex_dy,
+                           const Eigen::Vector3f& color, frame_stats& tile_counts)
 {
-    auto v = t.toVector4();
-    auto [alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-    float w_reciprocal = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-    float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-    z_interpolated *= w_reciprocal;
-    return z_interpolated;
+    fragment_packet& p = batch.packet;
+    int k = p.count++;
+    for (int c = 0; c < 3; ++c)
+    {
+        p.view_pos[c][k] = view_pos[c];
+        p.normal[c][k] = normal[c];
+        p.color[c][k] = color[c];
+    }
+    p.tex_coords[0][k] = tex_coords[0];
+    p.tex_coords[1][k] = tex_coords[1];
+    for (int c = 0; c < 2; ++c)
+    {
+        p.tex_dx[c][k] = tex_dx[c];
+        p.tex_dy[c][k] = tex_dy[c];
+    }
+    batch.x[k] = x;
+    batch.y[k] = y;
+
+    if (p.count == fragment_packet::width)
+        flush(batch, tile_counts);
+}
+
+void rst::rasterizer::flush(fragment_batch& batch, frame_stats& tile_counts)
+{
+    if (batch.packet.count == 0)
+        return;
+
+    long long start = profiling ? clock_ns() : 0;
+    color_packet out;
+    kernel(kernel_shader, batch.packet, out);
+    // in queue order, so a later fragment of the same pixel wins
+    for (int k = 0; k < batch.packet.count; ++k)
+        store_color(get_index(batch.x[k], batch.y[k]), Eigen::Vector3f(out.color[0][k], out.color[1][k], out.color[2][k]));
+
+    if (profiling)
+        tile_counts.time.shading += clock_ns() - start;
+    tile_counts.shaded_fragments += batch.packet.count;
+    batch.packet.count = 0;
+}
+
+void rst::rasterizer::add_counts(const frame_stats& tile_counts)
+{
+    std::lock_guard<std::mutex> lock(counts_mutex);
+    counts.triangles += tile_counts.triangles;
+    counts.backface_culled += tile_counts.backface_culled;
+    counts.frustum_culled += tile_counts.frustum_culled;
+    counts.clipped_triangles += tile_counts.clipped_triangles;
+    counts.hiz_blocks += tile_counts.hiz_blocks;
+    counts.early_z_fragments += tile_counts.early_z_fragments;
+    counts.visible_fragments += tile_counts.visible_fragments;
+    counts.shaded_fragments += tile_counts.shaded_fragments;
+    counts.time.vertex += tile_counts.time.vertex;
+    counts.time.setup += tile_counts.time.setup;
+    counts.time.raster += tile_counts.time.raster;
+    counts.time.depth += tile_counts.time.depth;
+    counts.time.shading += tile_counts.time.shading;
+    counts.time.output += tile_counts.time.output;
+}
+
+void rst::rasterizer::parallel_for(int count, loop_body call, const void* body)
+{
+    if (!pool || count <= 1)
+    {
+        for (int i = 0; i < count; ++i)
+            call(body, i);
+        return;
+    }
+
+    // Workers take the next index until none are left, so uneven tiles
+    // balance themselves
+    std::atomic<int> next{0};
+    std::vector<std::future<void>> done;
+    int workers = std::min<int>(pool->size(), count);
+    for (int w = 0; w < workers; ++w)
+    {
+        done.push_back(pool->submit([&] {
+            for (int i = next++; i < count; i = next++)
+                call(body, i);
+        }));
+    }
+    for (auto& d : done)
+        d.get();
 }
 
 //Screen space rasterization
-void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos) 
+void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos,
+                                         int x0, int y0, int x1, int y1, fragment_batch& batch, frame_stats& tile_counts)
 {
     // TODO: From your HW3, get the triangle rasterization code.
     auto v = t.toVector4();
@@ -286,63 +770,125 @@ void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eig
         b = std::min(v[i].y(), b);
         u = std::max(v[i].y(), u);
     }
-    // iterate through the pixel and find if the current pixel is inside the triangle
-    for (int i = std::floor(l); i < r && i < width; i++)
+
+    // Primitive assembly clipped t to the guard band, so setup only fails
+    // for triangles without area
+    triangle_edges edges;
+    if (!edges.setup(t.v))
+        return;
+
+    // The pixels floor(l) <= i < r and floor(b) <= j < u inside the rect,
+    // walked with the edge equations set up once per triangle
+    int i0 = std::max(x0, (int)std::floor(l)), i1 = std::min(x1, (int)std::ceil(r));
+    int j0 = std::max(y0, (int)std::floor(b)), j1 = std::min(y1, (int)std::ceil(u));
+
+    // An attribute divided by w is linear in screen space, as is 1 / w, so
+    // each gets a plane once per triangle. A pixel evaluates the planes
+    // from the corner (i0, j0), which keeps them accurate in float, and
+    // takes one reciprocal to undo the divide.
+    enum { one_over_w, color_a = 1, normal_a = 4, view_pos_a = 7, tex_a = 10, attributes = 12 };
+    float vertex_value[attributes][3];
+    for (int k = 0; k < 3; ++k)
     {
-        for (int j = std::floor(b); j < u && j < height; j++)
+        vertex_value[one_over_w][k] = 1.0f;
+        for (int c = 0; c < 3; ++c)
         {
-            // For pixel (i,j), it's centre is (i+0.5, j+0.5);
-            float x = i + 0.5f, y = j + 0.5f;   // centre coordinate
+            vertex_value[color_a + c][k] = t.color[k][c];
+            vertex_value[normal_a + c][k] = t.normal[k][c];
+            vertex_value[view_pos_a + c][k] = view_pos[k][c];
+        }
+        vertex_value[tex_a][k] = t.tex_coords[k].x();
+        vertex_value[tex_a + 1][k] = t.tex_coords[k].y();
+    }
+    // The plane of a / w is sum_k a_k / w_k times the plane of weight k
+    float weight_corner[3], weight_x[3], weight_y[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        plane_equation weight = edges.plane(k == 0, k == 1, k == 2);
+        float inv_w = 1.0f / t.v[k].w();
+        weight_corner[k] = float(weight.at(i0, j0)) * inv_w;
+        weight_x[k] = float(weight.dx) * inv_w;
+        weight_y[k] = float(weight.dy) * inv_w;
+    }
+    float at_corner[attributes], step_x[attributes], step_y[attributes];
+    for (int a = 0; a < attributes; ++a)
+    {
+        const float* value = vertex_value[a];
+        at_corner[a] = value[0] * weight_corner[0] + value[1] * weight_corner[1] + value[2] * weight_corner[2];
+        step_x[a] = value[0] * weight_x[0] + value[1] * weight_x[1] + value[2] * weight_x[2];
+        step_y[a] = value[0] * weight_y[0] + value[1] * weight_y[1] + value[2] * weight_y[2];
+    }
+
+    // Shades pixel (i, j), whose centre has barycentric coordinates alpha, beta, gamma
+    auto shade = [&](int i, int j, float alpha, float beta, float gamma)
+    {
+        // screen space depth is linear between zNear and zFar
+        float zp = alpha * v[0].z() + beta * v[1].z() + gamma * v[2].z();
 
-            Vector2i point(i, j);        // For set_pixel();
+        // Z-buffer, before any attribute is interpolated
+        if (!(zp < depth_buf[get_index(i, j)]))
+        {
+            tile_counts.early_z_fragments++;
+            return;
+        }
 
-            // What about anti-aliasing?
-            // super-sampling :
+        float dx = float(i - i0), dy = float(j - j0);
+        float value[attributes];
+        for (int a = 0; a < attributes; ++a)
+            value[a] = at_corner[a] + dx * step_x[a] + dy * step_y[a];
+        float w = 1.0f / value[one_over_w];
+        Eigen::Vector3f interpolated_color(value[color_a] * w, value[color_a + 1] * w, value[color_a + 2] * w);
+        Eigen::Vector3f interpolated_normal(value[normal_a] * w, value[normal_a + 1] * w, value[normal_a + 2] * w);
+        Eigen::Vector3f interpolated_shadingcoords(value[view_pos_a] * w, value[view_pos_a + 1] * w,
+                                                   value[view_pos_a + 2] * w);
+        Vector2f interpolated_texcoords(value[tex_a] * w, value[tex_a + 1] * w);
+
+        // The change of the texture coordinates to the next pixel, what a
+        // 2x2 quad of pixels would measure: d(u / w) / dx = (du / dx) / w +
+        // u * d(1 / w) / dx
+        Eigen::Vector2f tex_dx, tex_dy;
+        for (int c = 0; c < 2; ++c)
+        {
+            tex_dx[c] = (step_x[tex_a + c] - interpolated_texcoords[c] * step_x[one_over_w]) * w;
+            tex_dy[c] = (step_y[tex_a + c] - interpolated_texcoords[c] * step_y[one_over_w]) * w;
+        }
 
+        depth_buf[get_index(i, j)] = zp;
+        depth_stale[get_block(i, j)] = 1;
+        tile_counts.visible_fragments++;
 
-            if (insideTriangle(x, y, t.v))
-            {
-                // So before we interpolate it, we should know the pixel's barycentric coordinates
-                // alpha, beta gamma is what?
-                // They are calculated by Area of the triangle;
-                // We shall first apply inverse viewport transformation; (it
-                auto [alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-
-                // interpolate depth between zNear and zFar;
-                float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                zp *= Z;
-
-                
-                // Z-buffer
-                if (zp < depth_buf[get_index(i, j)])
-                {
-                    // interpolate color;
-
-
-                    auto interpolated_color = Z *  (alpha * t.color[0] + beta * t.color[1] + gamma * t.color[2]);
-                    auto interpolated_normal = Z * (alpha * t.normal[0] + beta * t.normal[1] + gamma * t.normal[2]);
-                    //interpolated_normal *= Z;
-                    Vector2f interpolated_texcoords = Z * (alpha * t.tex_coords[0] + beta * t.tex_coords[1] + gamma * t.tex_coords[2]);
-                    //interpolated_texcoords *= Z;
-                    if (interpolated_texcoords[0] > 1)
-                    {
-                        int kkk = 0;
-                    }
-                    // ?
-                    auto interpolated_shadingcoords = alpha * view_pos[0] + beta * view_pos[1] + gamma * view_pos[2];
-
-
-                    fragment_shader_payload payload(interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-                    payload.view_pos = interpolated_shadingcoords;
-
-                    depth_buf[get_index(i, j)] = zp;
-                    auto pixel_color = fragment_shader(payload);
-                    set_pixel(point, pixel_color);
-                }
-            }
+        if (shading == Shading::Deferred)
+        {
+            // shaded by shade_tile once the whole draw is rasterized
+            int index = get_index(i, j);
+            gbuffer[index] = {interpolated_shadingcoords, interpolated_normal.normalized(), interpolated_texcoords,
+                              tex_dx, tex_dy, interpolated_color};
+            gbuffer_written[index] = 1;
+            return;
         }
-    }
+
+        emit(batch, i, j, interpolated_shadingcoords, interpolated_normal.normalized(), interpolated_texcoords,
+             tex_dx, tex_dy, interpolated_color, tile_counts);
+    };
+
+    // zp is the plane through the vertex depths, so nothing in a block is
+    // nearer than the plane's minimum over it
+    plane_equation depth = edges.plane(v[0].z(), v[1].z(), v[2].z());
+    float nearest = std::min({v[0].z(), v[1].z(), v[2].z()});
+    auto visit = [&](int bx, int by)
+    {
+        double z = std::max<double>(nearest, depth.min(bx, by, bx + depth_block - 1, by + depth_block - 1));
+        // leave room for the rounding of the per pixel zp
+        z -= 1e-5 * (std::abs(z) + 1);
+        if (z >= block_max_depth(bx, by))
+        {
+            tile_counts.hiz_blocks++;
+            return false;
+        }
+        return true;
+    };
+    edges.rasterize(i0, j0, i1, j1, shade, visit);
+
     // TODO: Inside your rasterization loop:
     //    * v[i].w() is the vertex view space depth value z.
     //    * Z is interpolated view space depth for the current pixel
@@ -384,34 +930,200 @@ void rst::rasterizer::set_projection(const Eigen::Matrix4f& p)
 
 void rst::rasterizer::clear(rst::Buffers buff)
 {
-    if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
+    bool color = (buff & rst::Buffers::Color) == rst::Buffers::Color;
+    bool depth = (buff & rst::Buffers::Depth) == rst::Buffers::Depth;
+    for (unsigned char& state : tile_state)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        if (color && (state & color_drawn))
+            state = (state & ~color_drawn) | color_cleared;
+        if (depth && (state & depth_drawn))
+            state = (state & ~depth_drawn) | depth_cleared;
     }
-    if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
+    if (depth)
+        counts = frame_stats();
+}
+
+void rst::rasterizer::begin_tile(int tile, frame_stats* tile_counts)
+{
+    unsigned char& state = tile_state[tile];
+    bool timed = profiling && tile_counts;
+    if (state & color_cleared)
     {
-        std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        long long start = timed ? clock_ns() : 0;
+        clear_tile_color(tile);
+        if (timed)
+            tile_counts->time.output += clock_ns() - start;
     }
+    if (state & depth_cleared)
+    {
+        long long start = timed ? clock_ns() : 0;
+        clear_tile_depth(tile);
+        if (timed)
+            tile_counts->time.depth += clock_ns() - start;
+    }
+    state = color_drawn | depth_drawn;
+}
+
+void rst::rasterizer::clear_tile_color(int tile)
+{
+    int x0 = tile % tiles_x * tile_size;
+    int y0 = tile / tiles_x * tile_size;
+    int x1 = std::min(x0 + tile_size, width);
+    int y1 = std::min(y0 + tile_size, height);
+    // black is all zero bits in every format, apart from alpha
+    uint32_t black[3] = { 0, 0, 0 };
+    if (color_format == ColorFormat::BGRA8)
+        black[0] = 0xFF000000u;
+    else if (color_format == ColorFormat::BGRA16F)
+        black[1] = uint32_t(to_half(255)) << 16;
+    for (int j = y0; j < y1; j++)
+    {
+        uint32_t* row = &frame_buf[size_t(get_index(x0, j)) * words_per_pixel];
+        for (int i = 0; i < x1 - x0; i++)
+            for (int w = 0; w < words_per_pixel; w++)
+                row[i * words_per_pixel + w] = black[w];
+    }
+    tile_state[tile] &= ~color_cleared;
+}
+
+void rst::rasterizer::clear_tile_depth(int tile)
+{
+    int x0 = tile % tiles_x * tile_size;
+    int y0 = tile / tiles_x * tile_size;
+    int x1 = std::min(x0 + tile_size, width);
+    int y1 = std::min(y0 + tile_size, height);
+    for (int j = y0; j < y1; j++)
+    {
+        float* row = &depth_buf[get_index(x0, j)];
+        std::fill(row, row + (x1 - x0), std::numeric_limits<float>::infinity());
+    }
+    // tiles are whole depth blocks, but the last row and column may be cut
+    for (int by = y0; by < y1; by += depth_block)
+    {
+        for (int bx = x0; bx < x1; bx += depth_block)
+        {
+            depth_max[get_block(bx, by)] = std::numeric_limits<float>::infinity();
+            depth_stale[get_block(bx, by)] = 0;
+        }
+    }
+    tile_state[tile] &= ~depth_cleared;
+}
+
+void rst::rasterizer::set_color_format(ColorFormat format)
+{
+    color_format = format;
+    words_per_pixel = format == ColorFormat::BGR32F ? 3 : format == ColorFormat::BGRA16F ? 2 : 1;
+    frame_buf.assign(size_t(width) * height * words_per_pixel, 0);
+    for (unsigned char& state : tile_state)
+        state = (state & ~color_drawn) | color_cleared;
+}
+
+rst::frame_view rst::rasterizer::frame()
+{
+    parallel_for(tiles_x * tiles_y, [&](int tile) {
+        if (!(tile_state[tile] & color_cleared))
+            return;
+        long long start = profiling ? clock_ns() : 0;
+        clear_tile_color(tile);
+        if (profiling)
+        {
+            frame_stats tile_counts;
+            tile_counts.time.output = clock_ns() - start;
+            add_counts(tile_counts);
+        }
+    });
+    size_t row_bytes = size_t(width) * words_per_pixel * sizeof(uint32_t);
+    return { frame_buf.data(), width, height, row_bytes, color_format };
 }
 
 rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
-    frame_buf.resize(w * h);
     depth_buf.resize(w * h);
 
+    depth_blocks_x = (w + depth_block - 1) / depth_block;
+    int depth_blocks_y = (h + depth_block - 1) / depth_block;
+    depth_max.resize(depth_blocks_x * depth_blocks_y);
+    depth_stale.resize(depth_blocks_x * depth_blocks_y);
+
+    tiles_x = (w + tile_size - 1) / tile_size;
+    tiles_y = (h + tile_size - 1) / tile_size;
+    // every buffer starts out with a clear pending
+    tile_state.assign(tiles_x * tiles_y, color_cleared | depth_cleared);
+    set_color_format(ColorFormat::BGRA8);
+
     texture = std::nullopt;
+    set_threads(0);
+}
+
+void rst::rasterizer::set_shading(Shading mode)
+{
+    shading = mode;
+    if (shading == Shading::Deferred)
+    {
+        gbuffer.resize(width * height);
+        gbuffer_written.assign(width * height, 0);
+    }
+    else
+    {
+        gbuffer = std::vector<gbuffer_texel>();
+        gbuffer_written = std::vector<unsigned char>();
+    }
+}
+
+void rst::rasterizer::set_threads(unsigned int threads)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    pool = threads > 1 ? std::make_unique<ThreadPool>(threads) : nullptr;
 }
 
 int rst::rasterizer::get_index(int x, int y)
 {
-    return (height-y)*width + x;
+    return (height-1-y)*width + x;
+}
+
+float rst::rasterizer::block_max_depth(int x, int y)
+{
+    int block = get_block(x, y);
+    if (depth_stale[block])
+    {
+        float farthest = -std::numeric_limits<float>::infinity();
+        for (int j = y; j < std::min(y + depth_block, height); j++)
+            for (int i = x; i < std::min(x + depth_block, width); i++)
+                farthest = std::max(farthest, depth_buf[get_index(i, j)]);
+        depth_max[block] = farthest;
+        depth_stale[block] = 0;
+    }
+    return depth_max[block];
 }
 
 void rst::rasterizer::set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
 {
     //old index: auto ind = point.y() + point.x() * width;
-    int ind = (height-point.y())*width + point.x();
-    frame_buf[ind] = color;
+    int ind = (height-1-point.y())*width + point.x();
+    begin_tile(get_tile(point.x(), point.y()));
+    store_color(ind, color);
+}
+
+void rst::rasterizer::store_color(int index, const Eigen::Vector3f& color)
+{
+    uint32_t* pixel = &frame_buf[size_t(index) * words_per_pixel];
+    switch (color_format)
+    {
+    case ColorFormat::BGRA8:
+        pixel[0] = to_byte(color.z()) | uint32_t(to_byte(color.y())) << 8 | uint32_t(to_byte(color.x())) << 16 |
+                   0xFF000000u;
+        break;
+    case ColorFormat::BGRA16F:
+        pixel[0] = to_half(color.z()) | uint32_t(to_half(color.y())) << 16;
+        pixel[1] = to_half(color.x()) | uint32_t(to_half(255)) << 16;
+        break;
+    case ColorFormat::BGR32F:
+        std::memcpy(pixel, color.data() + 2, sizeof(float));
+        std::memcpy(pixel + 1, color.data() + 1, sizeof(float));
+        std::memcpy(pixel + 2, color.data(), sizeof(float));
+        break;
+    }
 }
 
 void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader)
@@ -7,9 +7,17 @@
 #include <Eigen/Eigen>
 #include <optional>
 #include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
 #include "global.hpp"
 #include "Shader.hpp"
 #include "Triangle.hpp"
+#include "BufferStore.hpp"
+#include "ThreadPool.hpp"
+#include "EdgeFunction.hpp"
+#include "Wireframe.hpp"
 
 using namespace Eigen;
 
@@ -57,14 +65,104 @@ namespace rst
         int col_id = 0;
     };
 
+    struct nor_buf_id
+    {
+        int nor_id = 0;
+    };
+
+    struct tex_buf_id
+    {
+        int tex_id = 0;
+    };
+
+    enum class Shading
+    {
+        // the fragment shader runs for every fragment passing the depth test
+        Forward,
+        // the fragments passing the depth test are stored in a G-buffer, and
+        // once a draw is rasterized each covered pixel is shaded once
+        Deferred
+    };
+
+    enum class Culling
+    {
+        // both sides of every triangle are drawn
+        None,
+        // triangles wound clockwise on screen face away and are dropped
+        Back
+    };
+
+    // How the color buffer stores a pixel: blue, green and red from 0 to
+    // 255, in the order OpenCV reads them, so a frame needs no conversion
+    // before it is encoded or shown
+    enum class ColorFormat
+    {
+        BGRA8,      // bytes, rounded to nearest even and clamped, alpha 255
+        BGRA16F,    // half floats, alpha 255
+        BGR32F      // floats
+    };
+
+    // The color buffer of a rasterizer, rows from the top of the image
+    struct frame_view
+    {
+        const void* data;
+        int width, height;
+        size_t row_bytes;
+        ColorFormat format;
+    };
+
+    // Nanoseconds spent in each stage, summed over the worker threads
+    struct stage_times
+    {
+        long long vertex = 0;   // vertex shader and transforms
+        long long setup = 0;    // primitive assembly: culling, clipping and binning
+        long long raster = 0;   // coverage, interpolation and the early depth test
+        long long depth = 0;    // depth buffer clears
+        long long shading = 0;  // fragment shader and color writes
+        long long output = 0;   // color buffer clears and frame export
+
+        long long total() const { return vertex + setup + raster + depth + shading + output; }
+    };
+
+    // Triangle and fragment counts since the depth buffer was last cleared
+    struct frame_stats
+    {
+        long long triangles = 0;            // triangles entering primitive assembly
+        long long backface_culled = 0;      // facing away from the camera
+        long long frustum_culled = 0;       // wholly outside the view frustum
+        long long clipped_triangles = 0;    // cut by the near plane or the guard band
+        long long hiz_blocks = 0;           // 8x8 blocks behind the depth buffer, skipped whole
+        long long early_z_fragments = 0;    // covered pixels that failed the depth test
+        long long visible_fragments = 0;    // fragments that passed the depth test
+        long long shaded_fragments = 0;     // fragment shader calls
+        stage_times time;                   // only measured while profiling
+
+        // shader calls deferred shading saved on overdrawn pixels
+        long long saved_shading() const { return visible_fragments - shaded_fragments; }
+
+        // share of the triangles that never reached the rasterizer
+        double culled_fraction() const
+        {
+            return triangles ? double(backface_culled + frustum_culled) / triangles : 0.0;
+        }
+    };
+
     class rasterizer
     {
     public:
         rasterizer(int w, int h);
-        pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
-        ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
-        col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
-        col_buf_id load_normals(const std::vector<Eigen::Vector3f>& normals);
+        // Copies the buffer, or takes it over when it is moved in
+        pos_buf_id load_positions(std::vector<Eigen::Vector3f> positions);
+        ind_buf_id load_indices(std::vector<Eigen::Vector3i> indices);
+        col_buf_id load_colors(std::vector<Eigen::Vector3f> colors);
+        nor_buf_id load_normals(std::vector<Eigen::Vector3f> normals);
+        tex_buf_id load_tex_coords(std::vector<Eigen::Vector2f> tex_coords);
+        // Draws from the caller's memory, which must outlive the draws
+        pos_buf_id load_positions(buffer_span<Eigen::Vector3f> positions);
+        ind_buf_id load_indices(buffer_span<Eigen::Vector3i> indices);
+        col_buf_id load_colors(buffer_span<Eigen::Vector3f> colors);
+        nor_buf_id load_normals(buffer_span<Eigen::Vector3f> normals);
+        tex_buf_id load_tex_coords(buffer_span<Eigen::Vector2f> tex_coords);
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
@@ -72,49 +170,291 @@ namespace rst
 
         void set_texture(Texture tex) { texture = tex; }
 
+        // The constants the shaders of the following draws read
+        void set_uniforms(const shader_uniforms& u) { uniforms = u; }
+
         void set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader);
         void set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader);
 
+        void set_shading(Shading mode);
+
+        // Culling::None until set, for meshes that are not closed
+        void set_culling(Culling mode) { culling = mode; }
+
+        // Measures the time of each stage into stats().time. Off until set,
+        // as the clock reads cost a few percent.
+        void set_profiling(bool on) { profiling = on; }
+
+        // Worker threads used by draw, 0 means one per core and 1 draws
+        // on the calling thread. The image is the same for any count.
+        void set_threads(unsigned int threads);
+
+        // ColorFormat::BGRA8 until set. Clears the color buffer.
+        void set_color_format(ColorFormat format);
+
         void set_pixel(const Vector2i &point, const Eigen::Vector3f &color);
 
+        // Only marks the tiles drawn since their last clear, which are
+        // cleared when next drawn or when the frame is read
         void clear(Buffers buff);
 
-        void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
+        // Draws indexed triangles. Colors are 0 to 255. Primitive::Line
+        // draws the edges of the triangles in white instead, each shared
+        // edge once.
+        void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, nor_buf_id nor_buffer,
+                  tex_buf_id tex_buffer, Primitive type);
+        // Shades with the std::function set by set_fragment_shader
         void draw(std::vector<Triangle *> &TriangleList);
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        // Shades with shader(const fragment_packet&, color_packet&), which
+        // the packet kernel calls directly and can inline
+        template <typename Shader>
+        void draw(std::vector<Triangle *> &TriangleList, const Shader& shader)
+        {
+            packet_kernel kernel = [](const void* s, const fragment_packet& in, color_packet& out) {
+                (*static_cast<const Shader*>(s))(in, out);
+            };
+            draw_packets(TriangleList, kernel, &shader);
+        }
+
+        template <typename Shader>
+        void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, nor_buf_id nor_buffer,
+                  tex_buf_id tex_buffer, Primitive type, const Shader& shader)
+        {
+            packet_kernel kernel = [](const void* s, const fragment_packet& in, color_packet& out) {
+                (*static_cast<const Shader*>(s))(in, out);
+            };
+            draw_indexed(pos_buffer, ind_buffer, col_buffer, nor_buffer, tex_buffer, type, kernel, &shader);
+        }
+
+        // The color buffer itself, valid until the next draw or clear
+        frame_view frame();
+
+        const frame_stats& stats() const { return counts; }
 
     private:
-        void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
+        // Shades a whole packet, one indirect call per packet rather than
+        // per fragment
+        using packet_kernel = void (*)(const void* shader, const fragment_packet& in, color_packet& out);
+
+        // A packet being filled, with the pixels its lanes belong to
+        struct fragment_batch
+        {
+            fragment_packet packet;
+            int x[fragment_packet::width];
+            int y[fragment_packet::width];
+        };
+
+        void draw_packets(std::vector<Triangle *> &TriangleList, packet_kernel kernel, const void* shader);
+        void draw_indexed(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, nor_buf_id nor_buffer,
+                          tex_buf_id tex_buffer, Primitive type, packet_kernel kernel, const void* shader);
+
+        // A vertex entering primitive assembly. Clipping interpolates
+        // everything but screen, which is the viewport position of clip.
+        struct clip_vertex
+        {
+            Eigen::Vector4f clip;
+            Eigen::Vector4f screen;
+            Eigen::Vector3f view_pos;
+            Eigen::Vector3f normal;
+            Eigen::Vector3f color;
+            Eigen::Vector2f tex_coords;
+        };
+
+        // The triangles primitive assembly passed for one chunk of the
+        // submitted triangles, in submission order
+        struct triangle_chunk
+        {
+            std::vector<Triangle> tris;
+            std::vector<std::array<Eigen::Vector3f, 3>> view_pos;
+            // bins[tile] lists the triangles overlapping a tile
+            std::vector<std::vector<int>> bins;
+            frame_stats counts;
+        };
+
+        // Derives the clip space planes of the current projection
+        void begin_clipping();
+        // Bit set of the clip planes p is outside of
+        unsigned int outcode(const Eigen::Vector4f& p) const;
+        // Signed distance of p from one of the planes, negative outside
+        float plane_distance(int plane, const Eigen::Vector4f& p) const;
+        // Homogeneous divide and viewport transformation
+        Eigen::Vector4f to_screen(const Eigen::Vector4f& p) const;
+
+        // Culls and clips triangle v, and bins what is left of it
+        void assemble_triangle(triangle_chunk& chunk, const clip_vertex* v, const unsigned int* codes);
+        // Bins a triangle that needs no clipping, returns false if it faces away
+        bool add_triangle(triangle_chunk& chunk, const clip_vertex& a, const clip_vertex& b, const clip_vertex& c);
+
+        // Sizes the chunks for count triangles, returns their number
+        int begin_binning(int count);
+        // Adds the last triangle of chunk to the bins of the tiles it overlaps
+        void bin_triangle(triangle_chunk& chunk);
+        // Rasterizes and shades the binned triangles
+        void raster_stage(int chunks);
+
+        // Queues a fragment for shading, shading the batch once it is full
+        void emit(fragment_batch& batch, int x, int y, const Eigen::Vector3f& view_pos, const Eigen::Vector3f& normal,
+                  const Eigen::Vector2f& tex_coords, const Eigen::Vector2f& tex_dx, const Eigen::Vector2f& tex_dy,
+                  const Eigen::Vector3f& color, frame_stats& tile_counts);
+        // Shades the queued fragments and writes them in queue order
+        void flush(fragment_batch& batch, frame_stats& tile_counts);
+
+        // Writes the visible part of every edge to the color buffer
+        void draw_wireframe(buffer_span<Eigen::Vector3f> positions, buffer_span<mesh_edge> edges);
 
-        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos);
+        // Rasterizes the part of t inside the pixel rect [x0, x1) x [y0, y1)
+        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos,
+                                int x0, int y0, int x1, int y1, fragment_batch& batch, frame_stats& tile_counts);
 
-        // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
+        // Draws the binned triangles of one tile in submission order
+        void rasterize_tile(int tile, int chunks);
+
+        // Runs the fragment shader on the G-buffer pixels of one tile
+        void shade_tile(int tile);
+
+        void add_counts(const frame_stats& tile_counts);
+
+        // Calls body(0) .. body(count - 1) on the worker threads. The body is
+        // called through a plain function pointer rather than wrapped in a
+        // std::function, which would allocate for lambdas with many captures.
+        template <typename Body>
+        void parallel_for(int count, const Body& body)
+        {
+            loop_body call = [](const void* b, int i) { (*static_cast<const Body*>(b))(i); };
+            parallel_for(count, call, &body);
+        }
+        using loop_body = void (*)(const void* body, int i);
+        void parallel_for(int count, loop_body call, const void* body);
+
+        // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> BINNING -> DRAWLINE/DRAWTRI -> FRAGSHADER
+
+        // Screen tiles are tile_size x tile_size pixels. Each tile is drawn
+        // by one worker, which owns its part of the color and depth buffers.
+        static constexpr int tile_size = 64;
+        static_assert(tile_size % triangle_edges::block_size == 0, "depth blocks must not straddle tiles");
+
+        // Clip planes, in outcode bit order. Triangles outside one of the
+        // view planes are dropped, but only the near plane and the guard
+        // band, far enough out for the fixed point setup, cut triangles;
+        // the rest of the frustum is left to the screen rect.
+        enum clip_plane
+        {
+            near_plane, far_plane,
+            left_plane, right_plane, bottom_plane, top_plane,
+            left_guard, right_guard, bottom_guard, top_guard,
+            clip_planes
+        };
+        static constexpr unsigned int cutting_planes =
+                1u << near_plane | 1u << left_guard | 1u << right_guard | 1u << bottom_guard | 1u << top_guard;
 
     private:
         Eigen::Matrix4f model;
         Eigen::Matrix4f view;
         Eigen::Matrix4f projection;
 
-        int normal_id = -1;
-
-        std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-        std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> col_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> nor_buf;
+        buffer_store<Eigen::Vector3f> pos_buf;
+        buffer_store<Eigen::Vector3i> ind_buf;
+        buffer_store<Eigen::Vector3f> col_buf;
+        buffer_store<Eigen::Vector3f> nor_buf;
+        buffer_store<Eigen::Vector2f> tex_buf;
+        // The unique edges of each index buffer, loaded with the same id
+        buffer_store<mesh_edge> edge_buf;
 
         std::optional<Texture> texture;
+        shader_uniforms uniforms;
 
         std::function<Eigen::Vector3f(fragment_shader_payload)> fragment_shader;
         std::function<Eigen::Vector3f(vertex_shader_payload)> vertex_shader;
 
-        std::vector<Eigen::Vector3f> frame_buf;
+        // The shader of the current draw
+        packet_kernel kernel = nullptr;
+        const void* kernel_shader = nullptr;
+
+        // words_per_pixel 32 bit words per pixel in color_format, rows from
+        // the top like depth_buf
+        ColorFormat color_format = ColorFormat::BGRA8;
+        int words_per_pixel = 1;
+        std::vector<uint32_t> frame_buf;
         std::vector<float> depth_buf;
         int get_index(int x, int y);
+        // Writes a 0 to 255 RGB color to pixel index in color_format
+        void store_color(int index, const Eigen::Vector3f& color);
+
+        // Per tile, which buffers were drawn to since they were last cleared
+        // and which clears are still to be applied
+        enum tile_flags : unsigned char
+        {
+            color_drawn = 1,
+            depth_drawn = 2,
+            color_cleared = 4,
+            depth_cleared = 8
+        };
+        std::vector<unsigned char> tile_state;
+        int get_tile(int x, int y) const { return y / tile_size * tiles_x + x / tile_size; }
+        // Applies the pending clears of a tile that is about to be drawn to,
+        // timing them into tile_counts if given
+        void begin_tile(int tile, frame_stats* tile_counts = nullptr);
+        void clear_tile_color(int tile);
+        void clear_tile_depth(int tile);
+
+        // Second depth level: the farthest depth in each 8x8 block of
+        // depth_buf. Writes only mark a block stale, its maximum is
+        // recomputed when the next triangle tests against it.
+        static constexpr int depth_block = triangle_edges::block_size;
+        std::vector<float> depth_max;
+        std::vector<unsigned char> depth_stale;
+        int depth_blocks_x;
+        int get_block(int x, int y) { return y / depth_block * depth_blocks_x + x / depth_block; }
+        // The farthest depth of the block whose first pixel is (x, y)
+        float block_max_depth(int x, int y);
+
+        // The fragment shader inputs of the visible fragment of each pixel,
+        // indexed like frame_buf; only allocated for deferred shading
+        struct gbuffer_texel
+        {
+            Eigen::Vector3f view_pos;
+            Eigen::Vector3f normal;
+            Eigen::Vector2f tex_coords;
+            Eigen::Vector2f tex_dx, tex_dy;
+            Eigen::Vector3f color;
+        };
+        Shading shading = Shading::Forward;
+        Culling culling = Culling::None;
+
+        // w of points in front of the camera has the sign of facing; facing
+        // times w lies between w_near and w_far inside the frustum, and
+        // |x| and |y| up to guard times that inside the guard band
+        float facing = 1.0f;
+        float w_near = 0.0f;
+        float w_far = std::numeric_limits<float>::infinity();
+        float guard = 1.0f;
+        std::vector<gbuffer_texel> gbuffer;
+        std::vector<unsigned char> gbuffer_written;
+
+        frame_stats counts;
+        std::mutex counts_mutex;
+        bool profiling = false;
 
         int width, height;
+        int tiles_x, tiles_y;
+
+        std::unique_ptr<ThreadPool> pool;
+
+        // Post-transform cache of the indexed draw, one entry per vertex
+        struct shaded_vertex
+        {
+            Eigen::Vector4f clip;
+            Eigen::Vector4f screen;
+            Eigen::Vector3f view_pos;
+            Eigen::Vector3f normal;
+            unsigned int outcode;
+        };
+        std::vector<shaded_vertex> vertex_cache;
+        // The projected positions of the current wireframe draw
+        std::vector<wire_vertex> wire_vertices;
 
-        int next_id = 0;
-        int get_next_id() { return next_id++; }
+        // Output of primitive assembly for the current draw
+        std::vector<triangle_chunk> assembled;
     };
 }
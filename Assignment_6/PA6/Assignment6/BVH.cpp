@@ -211,27 +211,30 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
 
 Intersection BVHAccel::Intersect(const Ray& ray) const
 {
-    Intersection isect;
-    if (!root)
-        return isect;
-    isect = BVHAccel::getIntersection(root, ray);
-    return isect;
+    HitRecord hit;
+    if (!IntersectHit(ray, hit))
+        return Intersection();
+    // the surface interaction is only built for the closest hit
+    return hit.obj->getSurfaceInteraction(ray, hit);
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+bool BVHAccel::IntersectHit(const Ray& ray, HitRecord& hit) const
 {
-    // TODO Traverse the BVH to find intersection
+    if (!root)
+        return false;
+    return BVHAccel::getHit(root, ray, hit);
+}
 
+bool BVHAccel::getHit(BVHBuildNode* node, const Ray& ray, HitRecord& hit) const
+{
     // һ ray ,  node  BVH  , ȡrayཻϢ. 
-    Intersection inter;
-
-    if (node == nullptr) return inter;
+    if (node == nullptr) return false;
 
     if (!node->bounds.IntersectP(ray, ray.direction_inv,
         std::array<int, 3>{int(ray.direction.x > 0), int(ray.direction.y > 0), int(ray.direction.z > 0)}))
     {
         // ǰ bounds ཻ : û
-        return inter;
+        return false;
     }
     // ཻ :
 
@@ -240,33 +243,19 @@ Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
     {
         assert(node->object != nullptr || node->object_list.size() != 0);
         if (node->object != nullptr)
-        return node->object->getIntersection(ray);
+        return node->object->intersectHit(ray, hit);
         
-        Intersection isec;
+        bool happened = false;
         for (auto& obj : node->object_list)
         {
-            auto temp= obj->getIntersection(ray);
-            if (temp.distance < isec.distance)
-            {
-                isec = temp;
-            }
+            happened |= obj->intersectHit(ray, hit);
         }
-        return isec;
+        return happened;
     }
 
     // Ҷӽ
-    auto interL = getIntersection(node->left, ray);   // ΧнϢ
-    auto interR = getIntersection(node->right, ray);
-
-    if (interL.distance < interR.distance)
-    {
-        inter = interL;
-    }
-    else
-    {
-        inter = interR;
-    }
-    
+    bool hitL = getHit(node->left, ray, hit);   // ΧнϢ
+    bool hitR = getHit(node->right, ray, hit);
 
-    return inter;
+    return hitL || hitR;
 }
\ No newline at end of file
@@ -33,7 +33,8 @@ public:
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
+    bool IntersectHit(const Ray &ray, HitRecord &hit) const;
+    bool getHit(BVHBuildNode* node, const Ray& ray, HitRecord& hit) const;
     bool IntersectP(const Ray &ray) const;
     BVHBuildNode* root;
 
@@ -26,4 +26,14 @@ struct Intersection
     Object* obj;
     Material* m;
 };
+
+// What BVH traversal carries around instead of a full Intersection. Only the
+// closest hit is turned into an Intersection, by obj->getSurfaceInteraction.
+struct HitRecord
+{
+    float t = std::numeric_limits<float>::max();
+    float u = 0, v = 0;     // barycentrics of v1 and v2 for triangles
+    uint32_t primId = 0;    // index of the triangle within its mesh
+    Object* obj = nullptr;
+};
 #endif //RAYTRACING_INTERSECTION_H
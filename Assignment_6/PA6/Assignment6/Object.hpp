@@ -19,6 +19,22 @@ public:
     virtual bool intersect(const Ray& ray) = 0;
     virtual bool intersect(const Ray& ray, float &, uint32_t &) const = 0;
     virtual Intersection getIntersection(Ray _ray) = 0;
+    // Closest-hit query for traversal: updates hit and returns true only if
+    // this object is hit closer than hit.t. The defaults go through
+    // getIntersection, the built-in primitives override both.
+    virtual bool intersectHit(const Ray& ray, HitRecord& hit)
+    {
+        Intersection isect = getIntersection(ray);
+        if (!isect.happened || isect.distance >= hit.t)
+            return false;
+        hit.t = isect.distance;
+        hit.obj = this;
+        return true;
+    }
+    virtual Intersection getSurfaceInteraction(const Ray& ray, const HitRecord&)
+    {
+        return getIntersection(ray);
+    }
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
@@ -45,23 +45,32 @@ public:
         return true;
     }
     Intersection getIntersection(Ray ray){
-        Intersection result;
-        result.happened = false;
+        HitRecord hit;
+        if (!intersectHit(ray, hit)) return Intersection();
+        return getSurfaceInteraction(ray, hit);
+    }
+    bool intersectHit(const Ray& ray, HitRecord& hit){
         Vector3f L = ray.origin - center;
         float a = dotProduct(ray.direction, ray.direction);
         float b = 2 * dotProduct(ray.direction, L);
         float c = dotProduct(L, L) - radius2;
         float t0, t1;
-        if (!solveQuadratic(a, b, c, t0, t1)) return result;
+        if (!solveQuadratic(a, b, c, t0, t1)) return false;
         if (t0 < 0) t0 = t1;
-        if (t0 < 0) return result;
+        if (t0 < 0 || t0 >= hit.t) return false;
+        hit.t = t0;
+        hit.obj = this;
+        return true;
+    }
+    Intersection getSurfaceInteraction(const Ray& ray, const HitRecord& hit){
+        Intersection result;
         result.happened=true;
 
-        result.coords = Vector3f(ray.origin + ray.direction * t0);
+        result.coords = Vector3f(ray.origin + ray.direction * hit.t);
         result.normal = normalize(Vector3f(result.coords - center));
         result.m = this->m;
         result.obj = this;
-        result.distance = t0;
+        result.distance = hit.t;
         return result;
 
     }
@@ -1,13 +1,14 @@
 #pragma once
 
 #include "BVH.hpp"
+#include "BinaryMesh.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
-#include "OBJ_Loader.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
 #include <cassert>
 #include <array>
+#include <stdexcept>
 
 bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
                           const Vector3f& v2, const Vector3f& orig,
@@ -60,6 +61,8 @@ public:
     bool intersect(const Ray& ray, float& tnear,
                    uint32_t& index) const override;
     Intersection getIntersection(Ray ray) override;
+    bool intersectHit(const Ray& ray, HitRecord& hit) override;
+    Intersection getSurfaceInteraction(const Ray& ray, const HitRecord& hit) override;
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const override
@@ -77,11 +80,11 @@ class MeshTriangle : public Object
 public:
     MeshTriangle(const std::string& filename)
     {
-        objl::Loader loader;
-        loader.LoadFile(filename);
-
-        assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
+        // .mesh files are mapped, .obj files parsed. A mapped file is
+        // verified whole, so a bad index cannot read past its positions.
+        objl::BinaryMesh mesh;
+        if (!mesh.Load(filename) || (mesh.IsMapped() && !mesh.Verify()))
+            throw std::runtime_error("cannot load mesh " + filename);
 
         Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
                                      std::numeric_limits<float>::infinity(),
@@ -89,13 +92,11 @@ public:
         Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
+        for (size_t i = 0; i < mesh.Indices.size(); i += 3) {
             std::array<Vector3f, 3> face_vertices;
             for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z) *
-                            60.f;
+                const auto& position = mesh.Positions[mesh.Indices[i + j]];
+                auto vert = Vector3f(position.X, position.Y, position.Z) * 60.f;
                 face_vertices[j] = vert;
 
                 min_vert = Vector3f(std::min(min_vert.x, vert.x),
@@ -186,6 +187,15 @@ public:
         return intersec;
     }
 
+    // hit.obj is set to the triangle that was hit, not to the mesh
+    bool intersectHit(const Ray& ray, HitRecord& hit)
+    {
+        if (!bvh || !bvh->IntersectHit(ray, hit))
+            return false;
+        hit.primId = static_cast<Triangle*>(hit.obj) - triangles.data();
+        return true;
+    }
+
     Bounds3 bounding_box;
     std::unique_ptr<Vector3f[]> vertices;
     uint32_t numTriangles;
@@ -210,34 +220,52 @@ inline Bounds3 Triangle::getBounds() { return Union(Bounds3(v0, v1), v2); }
 
 inline Intersection Triangle::getIntersection(Ray ray)
 {
-    Intersection inter;
+    HitRecord hit;
+    if (!intersectHit(ray, hit))
+        return Intersection();
 
+    return getSurfaceInteraction(ray, hit);
+}
+
+inline bool Triangle::intersectHit(const Ray& ray, HitRecord& hit)
+{
     if (dotProduct(ray.direction, normal) > 0)      // ڱ,ཻ
-        return inter;
+        return false;
     double u, v, t_tmp = 0;
     Vector3f pvec = crossProduct(ray.direction, e2);
     double det = dotProduct(e1, pvec);
     if (fabs(det) < EPSILON)        // ʽΪ0, ཻ
-        return inter;
+        return false;
 
     double det_inv = 1. / det;
     Vector3f tvec = ray.origin - v0;
     u = dotProduct(tvec, pvec) * det_inv;
     if (u < 0 || u > 1)
-        return inter;
+        return false;
     Vector3f qvec = crossProduct(tvec, e1);
     v = dotProduct(ray.direction, qvec) * det_inv;
     if (v < 0 || u + v > 1)
-        return inter;
+        return false;
     t_tmp = dotProduct(e2, qvec) * det_inv;
 
     // TODO find ray triangle intersection
-    if (t_tmp < 0) return inter;
+    if (t_tmp < 0 || t_tmp >= hit.t) return false;
+
+    hit.t = t_tmp;
+    hit.u = u;
+    hit.v = v;
+    hit.obj = this;
+    return true;
+}
+
+inline Intersection Triangle::getSurfaceInteraction(const Ray& ray, const HitRecord& hit)
+{
+    Intersection inter;
 
     inter.happened = true;
-    inter.coords = ray(t_tmp);
+    inter.coords = ray(hit.t);
     inter.m = m;
-    inter.distance = t_tmp;
+    inter.distance = hit.t;
     inter.normal = normal;
     inter.obj = this;
 
@@ -1,6 +1,29 @@
 #include <algorithm>
 #include <cassert>
 #include "BVH.hpp"
+#include "Sphere.hpp"
+#include "Triangle.hpp"
+
+static PrimType primTypeOf(Object* object)
+{
+    if (dynamic_cast<Triangle*>(object))
+        return PrimType::Triangle;
+    if (dynamic_cast<Sphere*>(object))
+        return PrimType::Sphere;
+    if (dynamic_cast<MeshTriangle*>(object))
+        return PrimType::Mesh;
+    return PrimType::Object;
+}
+
+// Appends objects to the typed array, returns the offset of the first one.
+template <typename Prim>
+static int appendAs(std::vector<Prim*>& prims, const std::vector<Object*>& objects)
+{
+    int offset = prims.size();
+    for (auto obj : objects)
+        prims.push_back(static_cast<Prim*>(obj));
+    return offset;
+}
 
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
                    SplitMethod splitMethod)
@@ -33,13 +56,16 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
     Bounds3 bounds;
     for (int i = 0; i < objects.size(); ++i)
         bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
+    bool sameType = std::all_of(objects.begin(), objects.end(), [&](auto obj) {
+        return primTypeOf(obj) == primTypeOf(objects[0]);
+    });
+    if ((int)objects.size() <= maxPrimsInNode && sameType) {
         // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
+        node->bounds = bounds;
         node->object = objects[0];
         node->left = nullptr;
         node->right = nullptr;
-        node->area = objects[0]->getArea();
+        buildLeaf(node, objects);
         return node;
     }
     else if (objects.size() == 2) {
@@ -96,58 +122,142 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
     return node;
 }
 
+void BVHAccel::buildLeaf(BVHBuildNode* node, const std::vector<Object*>& objects)
+{
+    node->primType = primTypeOf(objects[0]);
+    node->nPrimitives = objects.size();
+    node->area = 0;
+    for (auto obj : objects)
+        node->area += obj->getArea();
+
+    switch (node->primType) {
+    case PrimType::Triangle:
+        node->firstPrimOffset = appendAs(triangles, objects);
+        buildPacket(node);
+        break;
+    case PrimType::Sphere:
+        node->firstPrimOffset = appendAs(spheres, objects);
+        break;
+    case PrimType::Mesh:
+        node->firstPrimOffset = appendAs(meshes, objects);
+        break;
+    default:
+        node->firstPrimOffset = appendAs(others, objects);
+        break;
+    }
+}
+
+void BVHAccel::buildPacket(BVHBuildNode* node)
+{
+    if (node->nPrimitives > TrianglePacket::Width)
+        return;
+
+    TrianglePacket packet;
+    for (int i = 0; i < node->nPrimitives; ++i) {
+        auto tri = triangles[node->firstPrimOffset + i];
+        packet.set(i, tri->v0, tri->v1, tri->v2);
+    }
+    node->packetIndex = packets.size();
+    packets.push_back(packet);
+}
+
+template <typename Visitor>
+auto BVHAccel::visitLeaf(const BVHBuildNode* node, Visitor&& visit) const
+{
+    int first = node->firstPrimOffset, n = node->nPrimitives;
+    switch (node->primType) {
+    case PrimType::Triangle:
+        return visit(triangles.data() + first, n);
+    case PrimType::Sphere:
+        return visit(spheres.data() + first, n);
+    case PrimType::Mesh:
+        return visit(meshes.data() + first, n);
+    default:
+        return visit(others.data() + first, n);
+    }
+}
+
 Intersection BVHAccel::Intersect(const Ray& ray) const
 {
-    Intersection isect;
+    HitRecord hit;
+    if (!IntersectHit(ray, hit))
+        return Intersection();
+    // the surface interaction is only built for the closest hit
+    return hit.obj->getSurfaceInteraction(ray, hit);
+}
+
+bool BVHAccel::IntersectHit(const Ray& ray, HitRecord& hit) const
+{
     if (!root)
-        return isect;
-    isect = BVHAccel::getIntersection(root, ray);
-    return isect;
+        return false;
+    return BVHAccel::getHit(root, ray, WatertightRay(ray.origin, ray.direction), hit);
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+bool BVHAccel::intersectLeaf(BVHBuildNode* node, const Ray& ray, const WatertightRay& wray, HitRecord& hit) const
 {
-    // TODO Traverse the BVH to find intersection
-    Intersection inter;
+    if (node->packetIndex >= 0) {
+        int lane = intersectPacket(packets[node->packetIndex], wray, hit.t, hit.u, hit.v);
+        if (lane < 0)
+            return false;
+        hit.primId = node->firstPrimOffset + lane;
+        hit.obj = triangles[hit.primId];
+        return true;
+    }
 
-    if (node == nullptr) return inter;
+    return visitLeaf(node, [&](auto prims, int n) {
+        bool happened = false;
+        for (int i = 0; i < n; ++i) {
+            if (prims[i]->intersectHit(ray, hit)) {
+                // aggregates such as MeshTriangle report their own primitive
+                if (hit.obj == prims[i])
+                    hit.primId = node->firstPrimOffset + i;
+                happened = true;
+            }
+        }
+        return happened;
+    });
+}
+
+bool BVHAccel::getHit(BVHBuildNode* node, const Ray& ray, const WatertightRay& wray, HitRecord& hit) const
+{
+    if (node == nullptr) return false;
 
     if (!node->bounds.IntersectP(ray, ray.direction_inv,
         std::array<int, 3>{int(ray.direction.x > 0), int(ray.direction.y > 0), int(ray.direction.z > 0)}))
     {
         // ǰ bounds ཻ : û
-        return inter;
+        return false;
     }
     // ཻ :
 
     
     if (node->left == nullptr && node->right == nullptr)
     {
-        return node->object->getIntersection(ray);
+        return intersectLeaf(node, ray, wray, hit);
     }
 
     // Ҷӽ
-    auto interL = getIntersection(node->left, ray);   // ΧнϢ
-    auto interR = getIntersection(node->right, ray);
-
-    if (interL.distance < interR.distance)
-    {
-        inter = interL;
-    }
-    else
-    {
-        inter = interR;
-    }
-
+    bool hitL = getHit(node->left, ray, wray, hit);   // ΧнϢ
+    bool hitR = getHit(node->right, ray, wray, hit);
 
-    return inter;
+    return hitL || hitR;
 }
 
 
 void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
     if(node->left == nullptr || node->right == nullptr){
-        node->object->Sample(pos, pdf);
-        pdf *= node->area;
+        // pick one primitive of the leaf in proportion to its area
+        visitLeaf(node, [&](auto prims, int n) {
+            auto object = prims[0];
+            for (int i = 0; i < n; ++i) {
+                object = prims[i];
+                if (p < object->getArea())
+                    break;
+                p -= object->getArea();
+            }
+            object->Sample(pos, pdf);
+            pdf *= object->getArea();
+        });
         return;
     }
     if(p < node->left->area) getSample(node->left, p, pos, pdf);
@@ -14,10 +14,18 @@
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
 #include "Vector.hpp"
+#include "TrianglePacket.hpp"
 
 struct BVHBuildNode;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+class Triangle;
+class Sphere;
+class MeshTriangle;
+
+// Built-in primitive types get their own arrays and are called without
+// going through the Object vtable; anything else is a user Object.
+enum class PrimType : uint8_t { Triangle, Sphere, Mesh, Object };
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -33,17 +41,32 @@ public:
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
+    bool IntersectHit(const Ray &ray, HitRecord &hit) const;
+    bool getHit(BVHBuildNode* node, const Ray& ray, const WatertightRay& wray, HitRecord& hit) const;
+    bool intersectLeaf(BVHBuildNode* node, const Ray& ray, const WatertightRay& wray, HitRecord& hit) const;
     bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    BVHBuildNode* root = nullptr;
 
     // BVHAccel Private Methods
     BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    void buildLeaf(BVHBuildNode* node, const std::vector<Object*>& objects);
+    void buildPacket(BVHBuildNode* node);
+    // calls visit(prims, n) with a pointer to the leaf's slice of the typed
+    // array matching its PrimType, so the visitor is compiled once per type
+    template <typename Visitor>
+    auto visitLeaf(const BVHBuildNode* node, Visitor&& visit) const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
     std::vector<Object*> primitives;
+    // leaf primitives sorted by type, each leaf owns a contiguous slice of one
+    std::vector<Triangle*> triangles;
+    std::vector<Sphere*> spheres;
+    std::vector<MeshTriangle*> meshes;
+    std::vector<Object*> others;
+    // triangle leaves are also stored as one SoA packet
+    std::vector<TrianglePacket> packets;
 
     void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
     void Sample(Intersection &pos, float &pdf);
@@ -58,6 +81,8 @@ struct BVHBuildNode {
 
 public:
     int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
+    int packetIndex=-1;
+    PrimType primType=PrimType::Object;
     // BVHBuildNode Public Methods
     BVHBuildNode(){
         bounds = Bounds3();
@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <thread>
+#include <vector>
+#include "Benchmark.hpp"
+#include "BinaryMesh.hpp"
+#include "TrianglePacket.hpp"
+#include "global.hpp"
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    double secondsSince(Clock::time_point start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    // Same triangles, whether the meshes are indexed or not
+    bool sameMeshes(const objl::Loader& a, const objl::Loader& b)
+    {
+        auto sameVertex = [](const objl::Vertex& x, const objl::Vertex& y) {
+            return x.Position == y.Position && x.Normal == y.Normal &&
+                   x.TextureCoordinate == y.TextureCoordinate;
+        };
+        if (a.LoadedMeshes.size() != b.LoadedMeshes.size())
+            return false;
+        for (size_t i = 0; i < a.LoadedMeshes.size(); ++i) {
+            const objl::Mesh& x = a.LoadedMeshes[i];
+            const objl::Mesh& y = b.LoadedMeshes[i];
+            if (x.MeshName != y.MeshName || x.Indices.size() != y.Indices.size())
+                return false;
+            for (size_t j = 0; j < x.Indices.size(); ++j) {
+                if (!sameVertex(x.Vertices[x.Indices[j]], y.Vertices[y.Indices[j]]))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    double meshMegabytes(const objl::Loader& loader)
+    {
+        size_t bytes = 0;
+        for (auto& mesh : loader.LoadedMeshes)
+            bytes += mesh.Vertices.size() * sizeof(objl::Vertex) + mesh.Indices.size() * sizeof(unsigned int);
+        return bytes / 1e6;
+    }
+
+    // Loads path with both parsers, returns false if they disagree
+    bool benchObjFile(const std::string& path)
+    {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) {
+            std::cout << "  " << path << ": can not be opened\n";
+            return false;
+        }
+        double megabytes = file.tellg() / 1e6;
+
+        objl::Loader byLine, mapped;
+        auto start = Clock::now();
+        bool loadedByLine = byLine.LoadFileByLine(path);
+        double byLineTime = secondsSince(start);
+
+        start = Clock::now();
+        bool loadedMapped = mapped.LoadFile(path);
+        double mappedTime = secondsSince(start);
+
+        bool same = loadedByLine && loadedMapped && sameMeshes(byLine, mapped);
+        std::cout << "  " << path << " (" << megabytes << " MB, "
+                  << mapped.LoadedIndices.size() / 3 << " triangles)\n";
+        std::cout << "    by line: " << megabytes / byLineTime << " MB/s\n";
+        std::cout << "    mapped : " << megabytes / mappedTime << " MB/s, "
+                  << byLineTime / mappedTime << "x, " << (same ? "same meshes" : "MESHES DIFFER") << "\n";
+        std::cout << "    mesh memory: " << meshMegabytes(byLine) << " MB by line, "
+                  << meshMegabytes(mapped) << " MB indexed\n";
+
+        // the same mesh as a .mesh file, mapped instead of parsed
+        const std::string meshPath = "bench_mesh.mesh";
+        objl::WriteBinaryMesh(meshPath, mapped);
+        objl::BinaryMesh binary;
+        start = Clock::now();
+        bool opened = binary.Open(meshPath);
+        double openTime = secondsSince(start);
+        start = Clock::now();
+        bool verified = opened && binary.Verify();
+        double verifyTime = secondsSince(start);
+
+        bool sameBinary = verified && binary.Indices.size() == mapped.LoadedIndices.size();
+        for (size_t i = 0; sameBinary && i < binary.Indices.size(); ++i) {
+            const objl::Vertex& v = mapped.LoadedVertices[mapped.LoadedIndices[i]];
+            uint32_t index = binary.Indices[i];
+            sameBinary = binary.Positions[index] == v.Position && binary.Normals[index] == v.Normal &&
+                         binary.TexCoords[index] == v.TextureCoordinate;
+        }
+        std::cout << "    binary : " << openTime * 1e3 << " ms to map, " << verifyTime * 1e3
+                  << " ms to verify, vs " << mappedTime * 1e3 << " ms to parse, "
+                  << (sameBinary ? "same mesh" : "MESH DIFFERS") << "\n";
+        std::remove(meshPath.c_str());
+        return same && sameBinary;
+    }
+
+    // An n x n grid of triangles with texture coordinates and normals
+    void writeGridObj(const std::string& path, int n)
+    {
+        std::ofstream out(path);
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> height(-0.01f, 0.01f);
+        out << "o grid\n";
+        for (int y = 0; y <= n; ++y)
+            for (int x = 0; x <= n; ++x)
+                out << "v " << float(x) / n << ' ' << height(rng) << ' ' << float(y) / n << '\n';
+        for (int y = 0; y <= n; ++y)
+            for (int x = 0; x <= n; ++x)
+                out << "vt " << float(x) / n << ' ' << float(y) / n << '\n';
+        out << "vn 0 1 0\n";
+        for (int y = 0; y < n; ++y) {
+            for (int x = 0; x < n; ++x) {
+                int a = y * (n + 1) + x + 1, b = a + 1, c = a + n + 1, d = c + 1;
+                out << "f " << a << '/' << a << "/1 " << c << '/' << c << "/1 " << b << '/' << b << "/1\n";
+                out << "f " << b << '/' << b << "/1 " << c << '/' << c << "/1 " << d << '/' << d << "/1\n";
+            }
+        }
+    }
+}
+
+int benchTriangles()
+{
+    const int numPackets = 4096;
+    const int numRays = 2048;
+
+    std::mt19937 rng(101);
+    std::uniform_real_distribution<float> dist(-1.f, 1.f);
+    auto randomPoint = [&](float scale) {
+        return Vector3f(dist(rng), dist(rng), dist(rng)) * scale;
+    };
+
+    // small triangles around the origin, rays shot from a shell through it
+    std::vector<TrianglePacket> packets(numPackets);
+    for (auto& packet : packets) {
+        for (int lane = 0; lane < TrianglePacket::Width; ++lane) {
+            Vector3f c = randomPoint(1.f);
+            packet.set(lane, c + randomPoint(0.2f), c + randomPoint(0.2f), c + randomPoint(0.2f));
+        }
+    }
+    std::vector<WatertightRay> rays;
+    for (int i = 0; i < numRays; ++i) {
+        Vector3f orig = normalize(randomPoint(1.f)) * 4.f;
+        rays.emplace_back(orig, normalize(randomPoint(0.5f) - orig));
+    }
+
+    long long tests = (long long)numRays * numPackets * TrianglePacket::Width;
+    int hitsScalar = 0, hitsSimd = 0, mismatches = 0;
+
+    auto start = Clock::now();
+    for (auto& ray : rays) {
+        for (auto& packet : packets) {
+            float t = kInfinity, u, v;
+            hitsScalar += intersectPacketScalar(packet, ray, t, u, v) >= 0;
+        }
+    }
+    double scalarTime = secondsSince(start);
+
+    start = Clock::now();
+    for (auto& ray : rays) {
+        for (auto& packet : packets) {
+            float t = kInfinity, u, v;
+            hitsSimd += intersectPacket(packet, ray, t, u, v) >= 0;
+        }
+    }
+    double simdTime = secondsSince(start);
+
+    // validation pass, the tolerance only covers FMA contraction
+    for (auto& ray : rays) {
+        for (auto& packet : packets) {
+            float t0 = kInfinity, u0 = 0, v0 = 0, t1 = kInfinity, u1 = 0, v1 = 0;
+            int lane0 = intersectPacketScalar(packet, ray, t0, u0, v0);
+            int lane1 = intersectPacket(packet, ray, t1, u1, v1);
+            if (lane0 != lane1)
+                mismatches++;
+            else if (lane0 >= 0 && (std::fabs(t0 - t1) > 1e-4f * t0 ||
+                                    std::fabs(u0 - u1) > 1e-4f || std::fabs(v0 - v1) > 1e-4f))
+                mismatches++;
+        }
+    }
+
+    std::cout << "Triangle intersection, " << TrianglePacket::Width << " wide packets\n";
+    std::cout << "  scalar : " << tests / scalarTime / 1e6 << " M tests/s (" << hitsScalar << " hits)\n";
+    std::cout << "  packet : " << tests / simdTime / 1e6 << " M tests/s (" << hitsSimd << " hits)\n";
+    std::cout << "  speedup: " << scalarTime / simdTime << "x, mismatches: " << mismatches << "\n";
+
+    return mismatches == 0 ? 0 : 1;
+}
+
+int convertMesh(const std::string& objPath, const std::string& meshPath)
+{
+    objl::Loader loader;
+    if (!loader.LoadFile(objPath) || !objl::WriteBinaryMesh(meshPath, loader)) {
+        std::cerr << "Could not convert " << objPath << " to " << meshPath << "\n";
+        return 1;
+    }
+    std::cout << meshPath << ": " << loader.LoadedVertices.size() << " vertices, "
+              << loader.LoadedIndices.size() / 3 << " triangles\n";
+    return 0;
+}
+
+int benchObj(const std::string& path)
+{
+    const std::string gridPath = "bench_grid.obj";
+    writeGridObj(gridPath, 400);
+
+    std::cout << "OBJ loading, " << std::thread::hardware_concurrency() << " hardware threads\n";
+    bool same = benchObjFile(path);
+    same = benchObjFile(gridPath) && same;
+
+    std::remove(gridPath.c_str());
+    return same ? 0 : 1;
+}
@@ -0,0 +1,24 @@
+//
+// Micro benchmarks, run from main with a --bench-* argument instead of
+// rendering the Cornell box.
+//
+
+#pragma once
+
+#include <string>
+
+// Intersects random rays with random triangles, once through the scalar
+// reference and once through the SIMD packet kernel, checks that both agree
+// and prints the triangle tests per second of each.
+int benchTriangles();
+
+// Loads path and a large generated grid mesh with objl::Loader::LoadFile and
+// the line by line LoadFileByLine, checks that both give the same triangles
+// and prints the throughput of each in MB/s and the size of their meshes.
+// Then writes the mesh as a .mesh file and times mapping it.
+int benchObj(const std::string& path);
+
+// Writes the .obj file at objPath as a .mesh file at meshPath, which
+// MeshTriangle maps instead of parsing.
+int convertMesh(const std::string& objPath, const std::string& meshPath);
+
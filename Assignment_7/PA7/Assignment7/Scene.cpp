@@ -3,11 +3,54 @@
 //
 
 #include "Scene.hpp"
+#include "ThreadPool.hpp"
+#include "Triangle.hpp"
 
 
+void Scene::AddMesh(const std::string &filename, Material *material)
+{
+    pendingMeshes.push_back({filename, material, objects.size()});
+    objects.push_back(nullptr);
+}
+
+void Scene::loadPendingMeshes()
+{
+    if (pendingMeshes.empty())
+        return;
+
+    // every task parses one file and builds its BVH, the results are
+    // collected in queue order so the scene doesn't depend on timing
+    ThreadPool pool(std::min<unsigned int>(std::max(1u, std::thread::hardware_concurrency()),
+                                           pendingMeshes.size()));
+    std::vector<std::future<std::unique_ptr<MeshTriangle> > > loaded;
+    for (const auto &mesh : pendingMeshes) {
+        loaded.push_back(pool.submit([&mesh] {
+            return std::make_unique<MeshTriangle>(mesh.filename, mesh.material);
+        }));
+    }
+    for (size_t i = 0; i < loaded.size(); ++i) {
+        std::unique_ptr<MeshTriangle> mesh = loaded[i].get();
+        objects[pendingMeshes[i].slot] = mesh.get();
+        ownedObjects.push_back(std::move(mesh));
+    }
+    pendingMeshes.clear();
+}
+
 void Scene::buildBVH() {
+    loadPendingMeshes();
+
     printf(" - Generating BVH...\n\n");
     this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+
+    // the emitters don't change, so don't ask every object on every sample
+    emitters.clear();
+    emit_area_sum = 0;
+    for (auto object : objects) {
+        if (object->hasEmit()) {
+            emitters.push_back(object);
+            emit_area_sum += object->getArea();
+        }
+    }
 }
 
 Intersection Scene::intersect(const Ray &ray) const
@@ -15,23 +58,22 @@ Intersection Scene::intersect(const Ray &ray) const
     return this->bvh->Intersect(ray);
 }
 
-void Scene::sampleLight(Intersection &pos, float &pdf) const
+bool Scene::intersectHit(const Ray &ray, HitRecord &hit) const
+{
+    return this->bvh->IntersectHit(ray, hit);
+}
+
+void Scene::sampleLight(const Vector3f &ref, Intersection &pos, float &pdf) const
 {
-    float emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-        }
-    }
     float p = get_random_float() * emit_area_sum;       // ?? p 是发光光源面积的随机比例
-    emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-            if (p <= emit_area_sum){
-                objects[k]->Sample(pos, pdf);
-                break;
-            }
+    float area_sum = 0;
+    for (auto emitter : emitters) {
+        area_sum += emitter->getArea();
+        if (p <= area_sum){
+            emitter->SampleFrom(ref, pos, pdf);
+            // probability of having picked this emitter
+            pdf *= emitter->getArea() / emit_area_sum;
+            break;
         }
     }
 }
@@ -87,7 +129,7 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
     auto w_o = normalize(ray.origin - p);
     float pdf_light;
     Intersection light_sample;
-    sampleLight(light_sample, pdf_light);
+    sampleLight(p, light_sample, pdf_light);
     
     auto x = light_sample.coords;
     auto nn = light_sample.normal;
@@ -96,9 +138,11 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
 
     auto w_s = normalize(x - p);        // !! outwards
     // Then, use render equation
-    auto tem = intersect(Ray(p + EPSILON * inter.normal, w_s));
+    // only the distance of the blocker matters, no surface interaction needed
+    HitRecord tem;
+    intersectHit(Ray(p + EPSILON * inter.normal, w_s), tem);
     //auto tem = intersect(Ray(p, w_s));
-    if (tem.distance + 0.01f  >= (x - p).norm())
+    if (tem.t + 0.01f  >= (x - p).norm())
         L_dir += emit * inter.m->eval(w_s, w_o, inter.normal)
         * dotProduct(w_s, inter.normal) * dotProduct(-w_s, nn) / dotProduct(x - p, x - p) / std::max(pdf_light, 0.0000001f);
     // one sample light.
@@ -117,10 +161,9 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
         // sampling a direction :
         auto w_i = inter.m->sample(w_o, inter.normal);
         if (dotProduct(w_i, inter.normal) < 0) w_i = -w_i;      // keep outwards
-        auto ind = intersect(Ray(p + EPSILON * inter.normal, w_i));                  // indirect intersection
+        HitRecord ind;                  // indirect intersection
         
-        auto q = ind.coords;
-        if (ind.happened && !ind.m->hasEmission())
+        if (intersectHit(Ray(p + EPSILON * inter.normal, w_i), ind) && !ind.obj->hasEmit())
         {
             // No emission material
             // take w_i as output
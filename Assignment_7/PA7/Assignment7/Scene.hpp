@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <memory>
+#include <string>
 #include <vector>
 #include "Vector.hpp"
 #include "Object.hpp"
@@ -29,14 +31,21 @@ public:
 
     void Add(Object *object) { objects.push_back(object); }
     void Add(std::unique_ptr<Light> light) { lights.push_back(std::move(light)); }
+    // Queues an .obj or .mesh file, the scene owns the MeshTriangle made
+    // from it. It keeps its place among the added objects, but is only
+    // loaded by buildBVH.
+    void AddMesh(const std::string &filename, Material *material);
 
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
+    bool intersectHit(const Ray& ray, HitRecord& hit) const;
     BVHAccel *bvh;
+    // Loads the queued meshes and builds their BVHs on a thread pool, then
+    // builds the scene BVH once all of them are done
     void buildBVH();
     Vector3f castRay(const Ray &ray, int depth) const;
-    void sampleLight(Intersection &pos, float &pdf) const;
+    void sampleLight(const Vector3f &ref, Intersection &pos, float &pdf) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
                                                    const Vector3f &shadowPointOrig,
@@ -46,6 +55,20 @@ public:
     // creating the scene (adding objects and lights)
     std::vector<Object* > objects;
     std::vector<std::unique_ptr<Light> > lights;
+    // filled by buildBVH
+    std::vector<Object* > emitters;
+    float emit_area_sum = 0;
+
+    // meshes queued by AddMesh, with their slot in objects
+    struct PendingMesh
+    {
+        std::string filename;
+        Material *material;
+        size_t slot;
+    };
+    std::vector<PendingMesh> pendingMeshes;
+    std::vector<std::unique_ptr<Object> > ownedObjects;
+    void loadPendingMeshes();
 
     // Compute reflection direction
     Vector3f reflect(const Vector3f &I, const Vector3f &N) const
@@ -10,7 +10,7 @@
 #include "Bounds3.hpp"
 #include "Material.hpp"
 
-class Sphere : public Object{
+class Sphere final : public Object{
 public:
     Vector3f center;
     float radius, radius2;
@@ -47,23 +47,34 @@ public:
         return true;
     }
     Intersection getIntersection(Ray ray){
-        Intersection result;
-        result.happened = false;
+        HitRecord hit;
+        if (!intersectHit(ray, hit)) return Intersection();
+        return getSurfaceInteraction(ray, hit);
+    }
+    bool intersectHit(const Ray& ray, HitRecord& hit){
         Vector3f L = ray.origin - center;
         float a = dotProduct(ray.direction, ray.direction);
         float b = 2 * dotProduct(ray.direction, L);
         float c = dotProduct(L, L) - radius2;
         float t0, t1;
-        if (!solveQuadratic(a, b, c, t0, t1)) return result;
+        if (!solveQuadratic(a, b, c, t0, t1)) return false;
         if (t0 < 0) t0 = t1;
-        if (t0 < 0) return result;
+        if (t0 < 0 || t0 >= hit.t) return false;
+        hit.t = t0;
+        hit.obj = this;
+        return true;
+    }
+    Intersection getSurfaceInteraction(const Ray& ray, const HitRecord& hit){
+        Intersection result;
         result.happened=true;
 
-        result.coords = Vector3f(ray.origin + ray.direction * t0);
+        result.coords = Vector3f(ray.origin + ray.direction * hit.t);
         result.normal = normalize(Vector3f(result.coords - center));
         result.m = this->m;
         result.obj = this;
-        result.distance = t0;
+        result.distance = hit.t;
+        if (m->hasEmission())
+            result.emit = m->getEmission();
         return result;
 
     }
@@ -78,13 +89,69 @@ public:
                        Vector3f(center.x+radius, center.y+radius, center.z+radius));
     }
     void Sample(Intersection &pos, float &pdf){
-        float theta = 2.0 * M_PI * get_random_float(), phi = M_PI * get_random_float();
-        Vector3f dir(std::cos(phi), std::sin(phi)*std::cos(theta), std::sin(phi)*std::sin(theta));
+        // uniform over the whole surface
+        float z = 1.0f - 2.0f * get_random_float(), phi = 2.0f * M_PI * get_random_float();
+        float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+        Vector3f dir(r * std::cos(phi), r * std::sin(phi), z);
         pos.coords = center + radius * dir;
         pos.normal = dir;
         pos.emit = m->getEmission();
         pdf = 1.0f / area;
     }
+    void SampleFrom(const Vector3f &ref, Intersection &pos, float &pdf){
+        Vector3f wc = center - ref;
+        float dist2 = dotProduct(wc, wc);
+        if (dist2 <= radius2) {
+            // inside the sphere every point is visible
+            Sample(pos, pdf);
+            return;
+        }
+
+        // uniform direction inside the cone the sphere subtends from ref
+        float dist = std::sqrt(dist2);
+        float sinThetaMax2 = radius2 / dist2;
+        float cosThetaMax = std::sqrt(std::max(0.0f, 1.0f - sinThetaMax2));
+        float sinThetaMax = std::sqrt(sinThetaMax2);
+        float x_1 = get_random_float(), x_2 = get_random_float();
+        float cosTheta, sinTheta2, oneMinusCosThetaMax;
+        if (sinThetaMax2 < 1e-4f) {
+            // far away spheres: avoid the cancellation in 1 - cosThetaMax
+            oneMinusCosThetaMax = 0.5f * sinThetaMax2;
+            sinTheta2 = sinThetaMax2 * x_1;
+            cosTheta = std::sqrt(1.0f - sinTheta2);
+        }
+        else {
+            oneMinusCosThetaMax = 1.0f - cosThetaMax;
+            cosTheta = 1.0f - x_1 * oneMinusCosThetaMax;
+            sinTheta2 = std::max(0.0f, 1.0f - cosTheta * cosTheta);
+        }
+        float phi = 2.0f * M_PI * x_2;
+
+        // angle at the center between -wc and the point the direction hits,
+        // written without the d^2 + r^2 - ds^2 cancellation of the law of cosines
+        float cosAlpha = sinTheta2 / sinThetaMax +
+            cosTheta * std::sqrt(std::max(0.0f, 1.0f - sinTheta2 / sinThetaMax2));
+        cosAlpha = clamp(-1, 1, cosAlpha);
+        float sinAlpha = std::sqrt(std::max(0.0f, 1.0f - cosAlpha * cosAlpha));
+
+        Vector3f w = wc / dist, u, v;
+        if (std::fabs(w.x) > std::fabs(w.y))
+            u = Vector3f(-w.z, 0.0f, w.x) / std::sqrt(w.x * w.x + w.z * w.z);
+        else
+            u = Vector3f(0.0f, w.z, -w.y) / std::sqrt(w.y * w.y + w.z * w.z);
+        v = crossProduct(w, u);
+        Vector3f n = sinAlpha * std::cos(phi) * u + sinAlpha * std::sin(phi) * v - cosAlpha * w;
+
+        pos.coords = center + radius * n;
+        pos.normal = n;
+        pos.emit = m->getEmission();
+
+        // solid angle pdf converted to area measure, as the callers expect
+        Vector3f d = pos.coords - ref;
+        float d2 = dotProduct(d, d);
+        float cosLight = std::fabs(dotProduct(n, d)) / std::sqrt(d2);
+        pdf = cosLight / (d2 * 2.0f * M_PI * oneMinusCosThetaMax);
+    }
     float getArea(){
         return area;
     }
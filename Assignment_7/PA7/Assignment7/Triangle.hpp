@@ -1,15 +1,17 @@
 #pragma once
 
 #include "BVH.hpp"
+#include "BinaryMesh.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
-#include "OBJ_Loader.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
+#include "TrianglePacket.hpp"
 #include <cassert>
 #include <array>
+#include <stdexcept>
 
-bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
+inline bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
                           const Vector3f& v2, const Vector3f& orig,
                           const Vector3f& dir, float& tnear, float& u, float& v)
 {
@@ -39,7 +41,7 @@ bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
     return true;
 }
 
-class Triangle : public Object
+class Triangle final : public Object
 {
 public:
     Vector3f v0, v1, v2; // vertices A, B ,C , counter-clockwise order
@@ -62,6 +64,8 @@ public:
     bool intersect(const Ray& ray, float& tnear,
                    uint32_t& index) const override;
     Intersection getIntersection(Ray ray) override;
+    bool intersectHit(const Ray& ray, HitRecord& hit) override;
+    Intersection getSurfaceInteraction(const Ray& ray, const HitRecord& hit) override;
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const override
@@ -86,17 +90,18 @@ public:
     }
 };
 
-class MeshTriangle : public Object
+class MeshTriangle final : public Object
 {
 public:
     MeshTriangle(const std::string& filename, Material *mt = new Material())
     {
-        objl::Loader loader;
-        loader.LoadFile(filename);
+        // .mesh files are mapped, .obj files parsed. A mapped file is
+        // verified whole, so a bad index cannot read past its positions.
+        objl::BinaryMesh mesh;
+        if (!mesh.Load(filename) || (mesh.IsMapped() && !mesh.Verify()))
+            throw std::runtime_error("cannot load mesh " + filename);
         area = 0;
         m = mt;
-        assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
 
         Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
                                      std::numeric_limits<float>::infinity(),
@@ -104,13 +109,12 @@ public:
         Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
+        for (size_t i = 0; i < mesh.Indices.size(); i += 3) {
             std::array<Vector3f, 3> face_vertices;
 
             for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z);
+                const auto& position = mesh.Positions[mesh.Indices[i + j]];
+                auto vert = Vector3f(position.X, position.Y, position.Z);
                 face_vertices[j] = vert;
 
                 min_vert = Vector3f(std::min(min_vert.x, vert.x),
@@ -132,7 +136,7 @@ public:
             ptrs.push_back(&tri);
             area += tri.area;
         }
-        bvh = new BVHAccel(ptrs);
+        bvh = new BVHAccel(ptrs, TrianglePacket::Width);
     }
 
     bool intersect(const Ray& ray) { return true; }
@@ -194,6 +198,12 @@ public:
 
         return intersec;
     }
+
+    // hit.obj is set to the triangle that was hit, not to the mesh
+    bool intersectHit(const Ray& ray, HitRecord& hit)
+    {
+        return bvh && bvh->IntersectHit(ray, hit);
+    }
     
     void Sample(Intersection &pos, float &pdf){
         bvh->Sample(pos, pdf);
@@ -231,35 +241,36 @@ inline Bounds3 Triangle::getBounds() { return Union(Bounds3(v0, v1), v2); }
 
 inline Intersection Triangle::getIntersection(Ray ray)
 {
-    Intersection inter;
+    HitRecord hit;
+    if (!intersectHit(ray, hit))
+        return Intersection();
+
+    return getSurfaceInteraction(ray, hit);
+}
+
+inline bool Triangle::intersectHit(const Ray& ray, HitRecord& hit)
+{
+    // scalar path of the kernel in TrianglePacket.hpp, back faces are culled
+    float t_tmp, u, v;
+    if (!rayTriangleIntersectWatertight(v0, v1, v2, ray.origin, ray.direction,
+                                        t_tmp, u, v) || t_tmp >= hit.t)
+        return false;
 
-    if (dotProduct(ray.direction, normal) > 0)
-        return inter;
-    double u, v, t_tmp = 0;
-    Vector3f pvec = crossProduct(ray.direction, e2);
-    double det = dotProduct(e1, pvec);
-    if (fabs(det) < EPSILON)
-        return inter;
-
-    double det_inv = 1. / det;
-    Vector3f tvec = ray.origin - v0;
-    u = dotProduct(tvec, pvec) * det_inv;
-    if (u < 0 || u > 1)
-        return inter;
-    Vector3f qvec = crossProduct(tvec, e1);
-    v = dotProduct(ray.direction, qvec) * det_inv;
-    if (v < 0 || u + v > 1)
-        return inter;
-    t_tmp = dotProduct(e2, qvec) * det_inv;
-
-    // TODO find ray triangle intersection
-    // DONE
-    if (t_tmp < 0) return inter;
+    hit.t = t_tmp;
+    hit.u = u;
+    hit.v = v;
+    hit.obj = this;
+    return true;
+}
+
+inline Intersection Triangle::getSurfaceInteraction(const Ray& ray, const HitRecord& hit)
+{
+    Intersection inter;
 
     inter.happened = true;
-    inter.coords = ray(t_tmp);
+    inter.coords = ray(hit.t);
     inter.m = m;
-    inter.distance = t_tmp;
+    inter.distance = hit.t;
     inter.normal = normal;
     inter.obj = this;
     if (inter.obj->hasEmit())
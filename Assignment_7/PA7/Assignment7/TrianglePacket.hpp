@@ -0,0 +1,298 @@
+//
+// Single-precision, SoA-batched ray/triangle intersection.
+//
+// The test is the watertight one (Woop, Benthin, Wald 2013): the ray is
+// turned into a shear + permutation that maps it onto +z, and the three
+// 2D edge functions are evaluated in that space. Shared edges are then
+// tested with bit-identical arithmetic from both sides, so no ray can slip
+// through a crack between two triangles of a mesh.
+//
+// Only front faces are reported, i.e. triangles whose counter-clockwise
+// normal points against the ray, as Triangle::getIntersection always did.
+//
+
+#ifndef RAYTRACING_TRIANGLEPACKET_H
+#define RAYTRACING_TRIANGLEPACKET_H
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include "Vector.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RAYTRACING_PACKET_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RAYTRACING_PACKET_SSE
+#endif
+
+// Per-ray constants of the watertight test, computed once per traversal.
+struct WatertightRay
+{
+    int kx, ky, kz;      // permutation of the axes, kz is the dominant one
+    float Sx, Sy, Sz;    // shear that maps the direction onto +z
+    float org[3];
+
+    WatertightRay(const Vector3f& origin, const Vector3f& dir)
+    {
+        float d[3] = {dir.x, dir.y, dir.z};
+        org[0] = origin.x; org[1] = origin.y; org[2] = origin.z;
+
+        kz = 0;
+        if (std::fabs(d[1]) > std::fabs(d[kz])) kz = 1;
+        if (std::fabs(d[2]) > std::fabs(d[kz])) kz = 2;
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        // keep the winding of the projected triangle
+        if (d[kz] < 0) std::swap(kx, ky);
+
+        Sx = d[kx] / d[kz];
+        Sy = d[ky] / d[kz];
+        Sz = 1.0f / d[kz];
+    }
+};
+
+// Scalar reference of the packet kernel; also used for single triangles.
+// On a hit t, u (weight of v1) and v (weight of v2) are written out.
+inline bool rayTriangleIntersectWatertight(const Vector3f& v0, const Vector3f& v1,
+                                           const Vector3f& v2, const WatertightRay& r,
+                                           float& t, float& u, float& v)
+{
+    const float* p0 = &v0.x;
+    const float* p1 = &v1.x;
+    const float* p2 = &v2.x;
+
+    float Az = p0[r.kz] - r.org[r.kz];
+    float Bz = p1[r.kz] - r.org[r.kz];
+    float Cz = p2[r.kz] - r.org[r.kz];
+    float Ax = (p0[r.kx] - r.org[r.kx]) - r.Sx * Az;
+    float Ay = (p0[r.ky] - r.org[r.ky]) - r.Sy * Az;
+    float Bx = (p1[r.kx] - r.org[r.kx]) - r.Sx * Bz;
+    float By = (p1[r.ky] - r.org[r.ky]) - r.Sy * Bz;
+    float Cx = (p2[r.kx] - r.org[r.kx]) - r.Sx * Cz;
+    float Cy = (p2[r.ky] - r.org[r.ky]) - r.Sy * Cz;
+
+    float U = Cx * By - Cy * Bx;
+    float V = Ax * Cy - Ay * Cx;
+    float W = Bx * Ay - By * Ax;
+
+    // back faces and misses
+    if (U < 0 || V < 0 || W < 0)
+        return false;
+    float det = U + V + W;
+    if (det <= 0)
+        return false;
+
+    float T = r.Sz * (U * Az + V * Bz + W * Cz);
+    if (T < 0)
+        return false;
+
+    float invDet = 1.0f / det;
+    t = T / det;
+    u = V * invDet;
+    v = W * invDet;
+    return true;
+}
+
+inline bool rayTriangleIntersectWatertight(const Vector3f& v0, const Vector3f& v1,
+                                           const Vector3f& v2, const Vector3f& orig,
+                                           const Vector3f& dir, float& t, float& u, float& v)
+{
+    return rayTriangleIntersectWatertight(v0, v1, v2, WatertightRay(orig, dir), t, u, v);
+}
+
+// Up to Width triangles stored as SoA: v[vertex][axis][lane].
+// Unused lanes are degenerate (all zero) and can never be hit.
+struct alignas(32) TrianglePacket
+{
+#if defined(RAYTRACING_PACKET_AVX2)
+    static constexpr int Width = 8;
+#else
+    static constexpr int Width = 4;
+#endif
+
+    float v[3][3][Width];
+    int count;
+
+    TrianglePacket() : count(0)
+    {
+        for (auto& vert : v)
+            for (auto& axis : vert)
+                for (auto& lane : axis)
+                    lane = 0;
+    }
+
+    void set(int lane, const Vector3f& a, const Vector3f& b, const Vector3f& c)
+    {
+        const Vector3f* verts[3] = {&a, &b, &c};
+        for (int i = 0; i < 3; ++i) {
+            v[i][0][lane] = verts[i]->x;
+            v[i][1][lane] = verts[i]->y;
+            v[i][2][lane] = verts[i]->z;
+        }
+        count = std::max(count, lane + 1);
+    }
+
+    Vector3f vertex(int i, int lane) const
+    {
+        return Vector3f(v[i][0][lane], v[i][1][lane], v[i][2][lane]);
+    }
+};
+
+// Scalar loop over the packet, kept for validation of the SIMD kernel.
+// Returns the lane of the closest hit with t < tHit (updating tHit, u, v),
+// or -1 if there is none.
+inline int intersectPacketScalar(const TrianglePacket& p, const WatertightRay& r,
+                                 float& tHit, float& u, float& v)
+{
+    int hit = -1;
+    for (int lane = 0; lane < p.count; ++lane) {
+        float t, b1, b2;
+        if (rayTriangleIntersectWatertight(p.vertex(0, lane), p.vertex(1, lane),
+                                           p.vertex(2, lane), r, t, b1, b2) &&
+            t < tHit) {
+            tHit = t;
+            u = b1;
+            v = b2;
+            hit = lane;
+        }
+    }
+    return hit;
+}
+
+#if defined(RAYTRACING_PACKET_AVX2)
+
+inline int intersectPacket(const TrianglePacket& p, const WatertightRay& r,
+                           float& tHit, float& u, float& v)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 Sx = _mm256_set1_ps(r.Sx), Sy = _mm256_set1_ps(r.Sy);
+    const __m256 ox = _mm256_set1_ps(r.org[r.kx]);
+    const __m256 oy = _mm256_set1_ps(r.org[r.ky]);
+    const __m256 oz = _mm256_set1_ps(r.org[r.kz]);
+
+    __m256 Az = _mm256_sub_ps(_mm256_load_ps(p.v[0][r.kz]), oz);
+    __m256 Bz = _mm256_sub_ps(_mm256_load_ps(p.v[1][r.kz]), oz);
+    __m256 Cz = _mm256_sub_ps(_mm256_load_ps(p.v[2][r.kz]), oz);
+    __m256 Ax = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p.v[0][r.kx]), ox), _mm256_mul_ps(Sx, Az));
+    __m256 Ay = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p.v[0][r.ky]), oy), _mm256_mul_ps(Sy, Az));
+    __m256 Bx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p.v[1][r.kx]), ox), _mm256_mul_ps(Sx, Bz));
+    __m256 By = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p.v[1][r.ky]), oy), _mm256_mul_ps(Sy, Bz));
+    __m256 Cx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p.v[2][r.kx]), ox), _mm256_mul_ps(Sx, Cz));
+    __m256 Cy = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p.v[2][r.ky]), oy), _mm256_mul_ps(Sy, Cz));
+
+    __m256 U = _mm256_sub_ps(_mm256_mul_ps(Cx, By), _mm256_mul_ps(Cy, Bx));
+    __m256 V = _mm256_sub_ps(_mm256_mul_ps(Ax, Cy), _mm256_mul_ps(Ay, Cx));
+    __m256 W = _mm256_sub_ps(_mm256_mul_ps(Bx, Ay), _mm256_mul_ps(By, Ax));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(U, V), W);
+    __m256 T = _mm256_mul_ps(_mm256_set1_ps(r.Sz),
+                             _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(U, Az), _mm256_mul_ps(V, Bz)),
+                                           _mm256_mul_ps(W, Cz)));
+
+    __m256 valid = _mm256_and_ps(_mm256_cmp_ps(U, zero, _CMP_GE_OQ), _mm256_cmp_ps(V, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(W, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(det, zero, _CMP_GT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(T, zero, _CMP_GE_OQ));
+    if (_mm256_movemask_ps(valid) == 0)
+        return -1;
+
+    __m256 t = _mm256_div_ps(T, det);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(tHit), _CMP_LT_OQ));
+    int mask = _mm256_movemask_ps(valid);
+    if (mask == 0)
+        return -1;
+
+    alignas(32) float ts[8], Us[8], Vs[8], Ws[8], dets[8];
+    _mm256_store_ps(ts, t);
+    _mm256_store_ps(Us, U);
+    _mm256_store_ps(Vs, V);
+    _mm256_store_ps(Ws, W);
+    _mm256_store_ps(dets, det);
+
+    int hit = -1;
+    for (int lane = 0; lane < 8; ++lane) {
+        if ((mask >> lane & 1) && ts[lane] < tHit) {
+            tHit = ts[lane];
+            hit = lane;
+        }
+    }
+    float invDet = 1.0f / dets[hit];
+    u = Vs[hit] * invDet;
+    v = Ws[hit] * invDet;
+    return hit;
+}
+
+#elif defined(RAYTRACING_PACKET_SSE)
+
+inline int intersectPacket(const TrianglePacket& p, const WatertightRay& r,
+                           float& tHit, float& u, float& v)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 Sx = _mm_set1_ps(r.Sx), Sy = _mm_set1_ps(r.Sy);
+    const __m128 ox = _mm_set1_ps(r.org[r.kx]);
+    const __m128 oy = _mm_set1_ps(r.org[r.ky]);
+    const __m128 oz = _mm_set1_ps(r.org[r.kz]);
+
+    __m128 Az = _mm_sub_ps(_mm_load_ps(p.v[0][r.kz]), oz);
+    __m128 Bz = _mm_sub_ps(_mm_load_ps(p.v[1][r.kz]), oz);
+    __m128 Cz = _mm_sub_ps(_mm_load_ps(p.v[2][r.kz]), oz);
+    __m128 Ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p.v[0][r.kx]), ox), _mm_mul_ps(Sx, Az));
+    __m128 Ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p.v[0][r.ky]), oy), _mm_mul_ps(Sy, Az));
+    __m128 Bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p.v[1][r.kx]), ox), _mm_mul_ps(Sx, Bz));
+    __m128 By = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p.v[1][r.ky]), oy), _mm_mul_ps(Sy, Bz));
+    __m128 Cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p.v[2][r.kx]), ox), _mm_mul_ps(Sx, Cz));
+    __m128 Cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p.v[2][r.ky]), oy), _mm_mul_ps(Sy, Cz));
+
+    __m128 U = _mm_sub_ps(_mm_mul_ps(Cx, By), _mm_mul_ps(Cy, Bx));
+    __m128 V = _mm_sub_ps(_mm_mul_ps(Ax, Cy), _mm_mul_ps(Ay, Cx));
+    __m128 W = _mm_sub_ps(_mm_mul_ps(Bx, Ay), _mm_mul_ps(By, Ax));
+    __m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+    __m128 T = _mm_mul_ps(_mm_set1_ps(r.Sz),
+                          _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, Az), _mm_mul_ps(V, Bz)),
+                                     _mm_mul_ps(W, Cz)));
+
+    __m128 valid = _mm_and_ps(_mm_cmpge_ps(U, zero), _mm_cmpge_ps(V, zero));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(W, zero));
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(det, zero));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(T, zero));
+    if (_mm_movemask_ps(valid) == 0)
+        return -1;
+
+    __m128 t = _mm_div_ps(T, det);
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(tHit)));
+    int mask = _mm_movemask_ps(valid);
+    if (mask == 0)
+        return -1;
+
+    alignas(16) float ts[4], Us[4], Vs[4], Ws[4], dets[4];
+    _mm_store_ps(ts, t);
+    _mm_store_ps(Us, U);
+    _mm_store_ps(Vs, V);
+    _mm_store_ps(Ws, W);
+    _mm_store_ps(dets, det);
+
+    int hit = -1;
+    for (int lane = 0; lane < 4; ++lane) {
+        if ((mask >> lane & 1) && ts[lane] < tHit) {
+            tHit = ts[lane];
+            hit = lane;
+        }
+    }
+    float invDet = 1.0f / dets[hit];
+    u = Vs[hit] * invDet;
+    v = Ws[hit] * invDet;
+    return hit;
+}
+
+#else
+
+inline int intersectPacket(const TrianglePacket& p, const WatertightRay& r,
+                           float& tHit, float& u, float& v)
+{
+    return intersectPacketScalar(p, r, tHit, u, v);
+}
+
+#endif
+
+#endif //RAYTRACING_TRIANGLEPACKET_H
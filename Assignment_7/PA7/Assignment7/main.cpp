@@ -4,6 +4,7 @@
 #include "Sphere.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
+#include "Benchmark.hpp"
 #include <chrono>
 
 // In the main function of the program, we create the scene (create objects and
@@ -12,6 +13,12 @@
 // function().
 int main(int argc, char** argv)
 {
+    if (argc >= 2 && std::string(argv[1]) == "--bench-triangles")
+        return benchTriangles();
+    if (argc >= 2 && std::string(argv[1]) == "--bench-obj")
+        return benchObj(argc >= 3 ? argv[2] : "models/bunny/bunny.obj");
+    if (argc == 4 && std::string(argv[1]) == "--convert-mesh")
+        return convertMesh(argv[2], argv[3]);
 
     // Change the definition here to change resolution
     Scene scene(1024, 1024);
@@ -25,21 +32,19 @@ int main(int argc, char** argv)
     Material* light = new Material(DIFFUSE, (8.0f * Vector3f(0.747f+0.058f, 0.747f+0.258f, 0.747f) + 15.6f * Vector3f(0.740f+0.287f,0.740f+0.160f,0.740f) + 18.4f *Vector3f(0.737f+0.642f,0.737f+0.159f,0.737f)));
     light->Kd = Vector3f(0.65f);
     std::string model_path = "D:/Games101HomeWork/GAMES101_Homework/HomeworkForGames101/Assignment_7/PA7/Assignment7/models/";
-    MeshTriangle floor(model_path + "cornellbox/floor.obj", white);
-    MeshTriangle shortbox(model_path + "cornellbox/shortbox.obj", white);
-    MeshTriangle tallbox(model_path + "cornellbox/tallbox.obj", white);
-    MeshTriangle left(model_path + "cornellbox/left.obj", red);
-    MeshTriangle right(model_path + "cornellbox/right.obj", green);
-    MeshTriangle light_(model_path + "cornellbox/light.obj", light);
-
-    scene.Add(&floor);
-    scene.Add(&shortbox);
-    scene.Add(&tallbox);
-    scene.Add(&left);
-    scene.Add(&right);
-    scene.Add(&light_);
-
+    scene.AddMesh(model_path + "cornellbox/floor.obj", white);
+    scene.AddMesh(model_path + "cornellbox/shortbox.obj", white);
+    scene.AddMesh(model_path + "cornellbox/tallbox.obj", white);
+    scene.AddMesh(model_path + "cornellbox/left.obj", red);
+    scene.AddMesh(model_path + "cornellbox/right.obj", green);
+    scene.AddMesh(model_path + "cornellbox/light.obj", light);
+
+    // the meshes are loaded here, in parallel
+    auto loadStart = std::chrono::system_clock::now();
     scene.buildBVH();
+    auto loadStop = std::chrono::system_clock::now();
+    std::cout << "Scene loaded in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(loadStop - loadStart).count() << " ms\n";
 
     Renderer r;
 